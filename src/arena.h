@@ -0,0 +1,317 @@
+#ifndef ARENA_H
+#define ARENA_H
+
+#include <algorithm>
+#include <cstddef>
+#include <map>
+#include <mutex>
+#include <thread>
+#include <type_traits>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
+#include "yocto\yocto_gl.h"
+
+/**
+ * A monotonic (bump) allocator for objects living as long as a generated
+ * scene (shapes, instances, materials, parameters, ...).
+ *
+ * Allocations are served from large blocks and are never freed one by one:
+ * all the memory (and the destructors of the allocated objects) is released
+ * at once by release().
+ *
+ * Generation routines allocate through make_new/make_delete, which use the
+ * calling thread's current arena (see scoped_arena) or fall back to plain
+ * new/delete when there's none.
+ */
+
+namespace yb {
+
+	struct arena {
+		size_t block_size = 1 << 16;
+
+		// Memory blocks and their sizes. Blocks after the current one are
+		// empty and reused before allocating new ones.
+		std::vector<std::pair<char*, size_t>> blocks;
+		int cur_block = -1;
+		size_t cur_offset = 0;
+
+		// Destructors to run on release, in allocation order
+		std::vector<std::pair<void*, void(*)(void*)>> dtors;
+
+		arena(size_t block_size = 1 << 16) : block_size(block_size) {}
+		arena(const arena&) = delete;
+		arena& operator=(const arena&) = delete;
+		~arena();
+	};
+
+	/**
+	 * Blocks of all the arenas, as start -> (end, arena), to find the arena
+	 * an object was made from whichever arena is current (see make_delete)
+	 */
+	struct __arena_block_index {
+		std::mutex mtx;
+		std::map<const char*, std::pair<const char*, const arena*>> blocks;
+	};
+
+	__arena_block_index& __get_arena_block_index() {
+		static __arena_block_index index;
+		return index;
+	}
+
+	/**
+	 * Returns the arena whose blocks hold ptr, or nullptr for heap memory
+	 */
+	const arena* __find_owner_arena(const void* ptr) {
+		auto p = (const char*)ptr;
+		auto& index = __get_arena_block_index();
+		std::lock_guard<std::mutex> lock(index.mtx);
+		auto it = index.blocks.upper_bound(p);
+		if (it == index.blocks.begin()) return nullptr;
+		it--;
+		return p < it->second.first ? it->second.second : nullptr;
+	}
+
+	/**
+	 * Returns uninitialized memory from the arena
+	 */
+	void* allocate(arena* a, size_t size, size_t align = alignof(std::max_align_t)) {
+		if (a->cur_block < 0 && !a->blocks.empty()) {
+			a->cur_block = 0;
+			a->cur_offset = 0;
+		}
+		while (a->cur_block >= 0) {
+			auto& block = a->blocks[a->cur_block];
+			auto offset = (a->cur_offset + align - 1) / align * align;
+			if (offset + size <= block.second) {
+				a->cur_offset = offset + size;
+				return block.first + offset;
+			}
+			if (size_t(a->cur_block + 1) == a->blocks.size()) break;
+			a->cur_block++;
+			a->cur_offset = 0;
+		}
+		// Blocks grow geometrically (up to 256 times the base size) to keep
+		// their number, and thus the cost of owns, low
+		auto block_size = std::max(
+			a->block_size << std::min<size_t>(a->blocks.size(), 8), size + align
+		);
+		a->blocks.push_back({ new char[block_size], block_size });
+		{
+			auto& index = __get_arena_block_index();
+			std::lock_guard<std::mutex> lock(index.mtx);
+			index.blocks[a->blocks.back().first] = { a->blocks.back().first + block_size, a };
+		}
+		a->cur_block = a->blocks.size() - 1;
+		a->cur_offset = 0;
+		return allocate(a, size, align);
+	}
+
+	/**
+	 * Whether ptr was allocated from the arena
+	 */
+	bool owns(const arena* a, const void* ptr) {
+		auto p = (const char*)ptr;
+		for (int i = 0; i <= a->cur_block; i++) {
+			const auto& block = a->blocks[i];
+			if (p >= block.first && p < block.first + block.second) return true;
+		}
+		return false;
+	}
+
+	/**
+	 * Destroys all the objects allocated from the arena and frees its memory
+	 */
+	void release(arena* a) {
+		for (auto it = a->dtors.rbegin(); it != a->dtors.rend(); it++) {
+			it->second(it->first);
+		}
+		a->dtors.clear();
+		if (!a->blocks.empty()) {
+			auto& index = __get_arena_block_index();
+			std::lock_guard<std::mutex> lock(index.mtx);
+			for (const auto& block : a->blocks) index.blocks.erase(block.first);
+		}
+		for (auto& block : a->blocks) delete[] block.first;
+		a->blocks.clear();
+		a->cur_block = -1;
+		a->cur_offset = 0;
+	}
+
+	arena::~arena() { release(this); }
+
+	/**
+	 * Position in an arena, used to free the temporary allocations made after it
+	 */
+	struct arena_mark {
+		int block = -1;
+		size_t offset = 0;
+		size_t num_dtors = 0;
+	};
+
+	arena_mark get_mark(const arena* a) {
+		return { a->cur_block, a->cur_offset, a->dtors.size() };
+	}
+
+	/**
+	 * Frees everything allocated after the mark was taken.
+	 * The freed blocks are kept for later allocations.
+	 */
+	void rewind(arena* a, const arena_mark& mark) {
+		for (auto i = a->dtors.size(); i > mark.num_dtors; i--) {
+			a->dtors[i - 1].second(a->dtors[i - 1].first);
+		}
+		a->dtors.resize(mark.num_dtors);
+		a->cur_block = mark.block;
+		a->cur_offset = mark.offset;
+	}
+
+	// Arena used by make_new and make_delete on the calling thread
+	thread_local arena* __current_arena = nullptr;
+
+	arena* get_current_arena() { return __current_arena; }
+
+	/**
+	 * Sets the current arena of the calling thread for the lifetime of
+	 * the object, then restores the previous one
+	 */
+	struct scoped_arena {
+		arena* prev;
+		scoped_arena(arena* a) : prev(__current_arena) { __current_arena = a; }
+		~scoped_arena() { __current_arena = prev; }
+	};
+
+	/**
+	 * Frees, when going out of scope, all the temporary allocations made in
+	 * the current arena during the object's lifetime.
+	 * No allocation meant to outlive the scope must be made meanwhile.
+	 */
+	struct scoped_arena_rewind {
+		arena* a;
+		arena_mark mark;
+		scoped_arena_rewind() : a(__current_arena) { if (a) mark = get_mark(a); }
+		~scoped_arena_rewind() { if (a) rewind(a, mark); }
+	};
+
+	/**
+	 * Allocates an object from the current arena, or with new if there's none
+	 */
+	template<typename T, typename... Args>
+	T* make_new(Args&&... args) {
+		auto a = __current_arena;
+		if (!a) return new T(std::forward<Args>(args)...);
+		auto obj = new (allocate(a, sizeof(T), alignof(T))) T(std::forward<Args>(args)...);
+		if (!std::is_trivially_destructible<T>::value) {
+			a->dtors.push_back({ obj, [](void* p) { ((T*)p)->~T(); } });
+		}
+		return obj;
+	}
+
+	/**
+	 * Deletes an object made by make_new. Objects from an arena, current or
+	 * not (e.g. another building's or thread's), are left to be released
+	 * together with it.
+	 */
+	template<typename T>
+	void make_delete(T* obj) {
+		if (!obj) return;
+		if (__current_arena && owns(__current_arena, obj)) return;
+		if (__find_owner_arena(obj)) return;
+		delete obj;
+	}
+
+	/**
+	 * Allocator for standard containers, taking memory from the arena that
+	 * was current when it was created (or from the heap if there was none)
+	 */
+	template<typename T>
+	struct arena_allocator {
+		using value_type = T;
+
+		arena* a;
+
+		arena_allocator() : a(__current_arena) {}
+		template<typename U>
+		arena_allocator(const arena_allocator<U>& other) : a(other.a) {}
+
+		T* allocate(size_t n) {
+			if (!a) return (T*)::operator new(n * sizeof(T));
+			return (T*)yb::allocate(a, n * sizeof(T), alignof(T));
+		}
+
+		void deallocate(T* p, size_t) {
+			if (!a) ::operator delete(p);
+		}
+	};
+
+	template<typename T, typename U>
+	bool operator==(const arena_allocator<T>& a1, const arena_allocator<U>& a2) {
+		return a1.a == a2.a;
+	}
+
+	template<typename T, typename U>
+	bool operator!=(const arena_allocator<T>& a1, const arena_allocator<U>& a2) {
+		return a1.a != a2.a;
+	}
+
+	template<typename T>
+	using arena_vector = std::vector<T, arena_allocator<T>>;
+
+	/**
+	 * One arena per thread, for parallel generation
+	 */
+	struct arena_pool {
+		std::mutex mtx;
+		std::unordered_map<std::thread::id, arena*> arenas;
+
+		~arena_pool() {
+			for (auto& a : arenas) delete a.second;
+		}
+	};
+
+	/**
+	 * Returns the calling thread's arena in the pool
+	 */
+	arena* thread_arena(arena_pool& pool) {
+		std::lock_guard<std::mutex> lock(pool.mtx);
+		auto& a = pool.arenas[std::this_thread::get_id()];
+		if (!a) a = new arena();
+		return a;
+	}
+
+	/**
+	 * Releases all the arenas in the pool.
+	 *
+	 * If a scene is given, the objects allocated from the arenas are first
+	 * removed from it, so that the scene doesn't delete them later.
+	 */
+	void release(arena_pool& pool, ygl::scene* scn = nullptr) {
+		std::lock_guard<std::mutex> lock(pool.mtx);
+		if (scn) {
+			std::vector<std::pair<char*, size_t>> blocks;
+			for (const auto& a : pool.arenas) {
+				blocks.insert(blocks.end(), a.second->blocks.begin(), a.second->blocks.end());
+			}
+			std::sort(blocks.begin(), blocks.end());
+			auto from_arena = [&blocks](const void* ptr) {
+				auto p = (char*)ptr;
+				auto it = std::upper_bound(
+					blocks.begin(), blocks.end(), std::make_pair(p, ~size_t(0))
+				);
+				if (it == blocks.begin()) return false;
+				it--;
+				return p < it->first + it->second;
+			};
+			auto remove_owned = [&from_arena](auto& v) {
+				v.erase(std::remove_if(v.begin(), v.end(), from_arena), v.end());
+			};
+			remove_owned(scn->instances);
+			remove_owned(scn->shapes);
+			remove_owned(scn->materials);
+		}
+		for (auto& a : pool.arenas) release(a.second);
+	}
+}
+
+#endif // ARENA_H
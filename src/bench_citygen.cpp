@@ -0,0 +1,181 @@
+#include <cstdio>
+#include <fstream>
+#include <sstream>
+#include <string>
+#include <thread>
+#include <vector>
+
+#ifdef _WIN32
+#define NOMINMAX
+#include <windows.h>
+#include <psapi.h>
+#else
+#include <sys/resource.h>
+#endif
+
+#include "yocto/yocto_gl.h"
+#include "yocto/ext/json.hpp"
+
+#include "arena.h"
+#include "building_utils.h"
+#include "city_utils.h"
+#include "yocto_utils.h"
+
+// Peak resident set size of the process so far, in bytes
+size_t get_peak_rss() {
+#ifdef _WIN32
+	PROCESS_MEMORY_COUNTERS pmc;
+	GetProcessMemoryInfo(GetCurrentProcess(), &pmc, sizeof(pmc));
+	return pmc.PeakWorkingSetSize;
+#else
+	rusage ru;
+	getrusage(RUSAGE_SELF, &ru);
+#ifdef __APPLE__
+	return ru.ru_maxrss;
+#else
+	return size_t(ru.ru_maxrss) * 1024;
+#endif
+#endif
+}
+
+// Generates cities of increasing size as main does (without saving them),
+// reporting throughput, memory and scene statistics. Results can be compared
+// against a baseline saved by a previous run, to catch regressions.
+int main(int argc, char** argv) {
+	auto parser =
+		ygl::make_parser(argc, argv, "bench_citygen", "time the generation of cities of several sizes");
+	std::string sizes_str =
+		ygl::parse_opt(parser, "--sizes", "", "comma separated numbers of buildings on a side", std::string("4,14,50,100"));
+	int seed =
+		ygl::parse_opt(parser, "--seed", "-s", "cities' seed", 0);
+	int num_threads =
+		ygl::parse_opt(parser, "--threads", "-t", "number of generation threads (0 for all cores)", 1);
+	bool instanced_floors =
+		ygl::parse_flag(parser, "--instanced-floors", "", "share floor shapes among floors of non-widening buildings", false, false);
+	std::string baseline_filename =
+		ygl::parse_opt(parser, "--baseline", "-b", "results of a previous run to compare with", std::string());
+	float tolerance =
+		ygl::parse_opt(parser, "--tolerance", "", "relative throughput loss reported as a regression", 0.1f);
+	std::string filename =
+		ygl::parse_opt(parser, "--output", "-o", "results filename", std::string("bench_citygen.json"));
+	if (should_exit(parser)) {
+		printf("%s\n", get_usage(parser).c_str());
+		exit(1);
+	}
+	if (num_threads <= 0) num_threads = std::thread::hardware_concurrency();
+
+	std::vector<int> sizes;
+	std::stringstream ss(sizes_str);
+	for (std::string s; std::getline(ss, s, ',');) sizes.push_back(std::stoi(s));
+
+	ygl::shape *open_window_shape, *closed_window_shape;
+	std::tie(open_window_shape, closed_window_shape) =
+		yb::make_test_windows("wnd_op", "wnd_cls");
+	for (auto shp : { open_window_shape, closed_window_shape }) {
+		ygl::facet_shape(shp);
+		shp->norm = ygl::compute_normals(shp->lines, shp->triangles, shp->quads, shp->pos);
+	}
+
+	auto pool = num_threads > 1 ? ygl::make_pool(num_threads) : nullptr;
+	nlohmann::json results;
+	results["seed"] = seed;
+	results["threads"] = num_threads;
+	results["cities"] = nlohmann::json::array();
+	// Peak RSS only grows, so sizes are best given in increasing order
+	for (auto side : sizes) {
+		yb::city_params city_pars;
+		city_pars.buildings_per_side = side;
+		city_pars.seed = seed;
+		city_pars.instanced_floors = instanced_floors;
+		city_pars.open_window_shape = open_window_shape;
+		city_pars.closed_window_shape = closed_window_shape;
+		city_pars.window_width = yb::get_window_width(open_window_shape, closed_window_shape);
+		auto num_buildings = side*side;
+
+		auto scn = new ygl::scene();
+		yb::arena_pool arenas;
+		yb::material_cache mat_cache;
+		ygl::timer tmr;
+		std::vector<std::vector<ygl::instance*>> buildings_insts(num_buildings);
+		auto make_city_building = [&](int i) {
+			yb::scoped_arena arena_scope(yb::thread_arena(arenas));
+			ygl::rng_pcg32 rng;
+			auto params = yb::make_city_building_params(city_pars, i, rng);
+			params->mat_cache = &mat_cache;
+			buildings_insts[i] = yb::make_city_building(city_pars, i, *params);
+		};
+		if (pool) {
+			ygl::parallel_for(pool, num_buildings, make_city_building);
+		}
+		else {
+			for (int i = 0; i < num_buildings; i++) make_city_building(i);
+		}
+		auto builder = yb::make_scene_builder(scn);
+		for (const auto& insts : buildings_insts) yb::add_to_scene(builder, insts);
+		yb::commit(builder);
+		auto seconds = tmr.elapsed();
+
+		size_t num_vertices = 0, num_triangles = 0;
+		for (auto shp : scn->shapes) {
+			num_vertices += shp->pos.size();
+			num_triangles += shp->triangles.size() + shp->quads.size() * 2;
+		}
+		nlohmann::json res;
+		res["buildings_per_side"] = side;
+		res["buildings"] = num_buildings;
+		res["seconds"] = seconds;
+		res["buildings_per_s"] = num_buildings / seconds;
+		res["vertices_per_s"] = num_vertices / seconds;
+		res["peak_rss_mb"] = get_peak_rss() / (1024.0 * 1024.0);
+		res["shapes"] = scn->shapes.size();
+		res["instances"] = scn->instances.size();
+		res["materials"] = scn->materials.size();
+		res["vertices"] = num_vertices;
+		res["triangles"] = num_triangles;
+		results["cities"].push_back(res);
+		printf("%4dx%-4d %8.3f s  %9.1f buildings/s  %11.1f vertices/s  peak %8.1f MB  "
+			"%zu shapes  %zu instances  %zu vertices  %zu triangles\n",
+			side, side, seconds, num_buildings / seconds, num_vertices / seconds,
+			res["peak_rss_mb"].get<double>(), scn->shapes.size(), scn->instances.size(),
+			num_vertices, num_triangles);
+
+		// The window shapes outlive the city
+		yb::remove_from_scene(scn, { open_window_shape, closed_window_shape });
+		yb::release(arenas, scn);
+		delete scn;
+	}
+	if (pool) delete pool;
+
+	std::ofstream(filename) << results.dump(2) << "\n";
+
+	if (baseline_filename.empty()) return 0;
+	std::ifstream baseline_file(baseline_filename);
+	if (!baseline_file) throw std::runtime_error("cannot open " + baseline_filename);
+	nlohmann::json baseline;
+	baseline_file >> baseline;
+	// Throughput can vary between runs, while with the same seed the scenes
+	// must be identical
+	auto same_seed = baseline["seed"] == results["seed"];
+	if (!same_seed) printf("baseline has a different seed, scenes not compared\n");
+	auto num_regressions = 0;
+	for (const auto& res : results["cities"]) {
+		for (const auto& base : baseline["cities"]) {
+			if (base["buildings_per_side"] != res["buildings_per_side"]) continue;
+			auto side = res["buildings_per_side"].get<int>();
+			for (auto key : { "buildings_per_s", "vertices_per_s" }) {
+				auto ratio = res[key].get<double>() / base[key].get<double>();
+				if (ratio >= 1.0 - tolerance) continue;
+				printf("REGRESSION %dx%d %s: %.1f -> %.1f (%+.1f%%)\n", side, side, key,
+					base[key].get<double>(), res[key].get<double>(), (ratio - 1.0)*100.0);
+				num_regressions++;
+			}
+			for (auto key : { "shapes", "instances", "materials", "vertices", "triangles" }) {
+				if (!same_seed || base[key] == res[key]) continue;
+				printf("CHANGED %dx%d %s: %s -> %s\n", side, side, key,
+					base[key].dump().c_str(), res[key].dump().c_str());
+				num_regressions++;
+			}
+		}
+	}
+	return num_regressions ? 1 : 0;
+}
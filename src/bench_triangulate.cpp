@@ -0,0 +1,82 @@
+#include <chrono>
+#include <cstdio>
+#include <string>
+
+#include "yocto/yocto_gl.h"
+
+#include "geom_utils.h"
+#include "building_utils.h"
+
+// Compares the direct convex/monotone triangulations with poly2tri's CDT
+// on the floor and belt borders of random buildings
+int main(int argc, char** argv) {
+	auto parser =
+		ygl::make_parser(argc, argv, "bench_triangulate", "time the triangulation paths on buildings' borders");
+	int num_buildings =
+		ygl::parse_opt(parser, "--num-buildings", "-n", "number of random buildings", 1000);
+	int repeat =
+		ygl::parse_opt(parser, "--repeat", "-r", "times each polygon is triangulated", 20);
+	int seed =
+		ygl::parse_opt(parser, "--seed", "-s", "buildings' seed", 0);
+	if (should_exit(parser)) {
+		printf("%s\n", get_usage(parser).c_str());
+		exit(1);
+	}
+
+	// Borders, grouped by kind
+	std::vector<std::vector<ygl::vec2f>> polygons[3];
+	ygl::rng_pcg32 rng = ygl::init_rng(seed);
+	for (int i = 0; i < num_buildings; i++) {
+		auto params = yb::make_rand_building_params(rng, nullptr, nullptr, "building" + std::to_string(i));
+		for (const auto& border : yb::make_floor_borders_from_params(*params)) {
+			polygons[int(yb::classify_polygon(border))].push_back(border);
+			auto belt = yb::expand_polygon(border, params->belt_additional_width);
+			polygons[int(yb::classify_polygon(belt))].push_back(belt);
+		}
+		yb::make_delete(params);
+	}
+
+	auto& trg = yb::get_thread_triangulator();
+	auto time_ms = [repeat](const std::vector<std::vector<ygl::vec2f>>& polys, auto&& triangulate) {
+		size_t num_triangles = 0;
+		auto start = std::chrono::high_resolution_clock::now();
+		for (int r = 0; r < repeat; r++) {
+			for (const auto& p : polys) num_triangles += triangulate(p);
+		}
+		auto end = std::chrono::high_resolution_clock::now();
+		return std::make_tuple(
+			std::chrono::duration<double, std::milli>(end - start).count(), num_triangles / repeat
+		);
+	};
+	auto cdt = [&trg](const std::vector<ygl::vec2f>& p) {
+		return std::get<0>(yb::triangulate_cdt_indexed(trg, p)).size();
+	};
+
+	const char* names[] = { "convex", "monotone", "general" };
+	for (int k = 0; k < 3; k++) {
+		const auto& polys = polygons[k];
+		if (polys.empty()) continue;
+		double cdt_ms, fast_ms;
+		size_t cdt_tris, fast_tris;
+		std::tie(cdt_ms, cdt_tris) = time_ms(polys, cdt);
+		if (k == int(yb::polygon_kind::convex)) {
+			std::tie(fast_ms, fast_tris) = time_ms(polys, [](const std::vector<ygl::vec2f>& p) {
+				return yb::triangulate_convex(p).size();
+			});
+		}
+		else if (k == int(yb::polygon_kind::monotone)) {
+			std::tie(fast_ms, fast_tris) = time_ms(polys, [](const std::vector<ygl::vec2f>& p) {
+				return yb::triangulate_monotone(p).size();
+			});
+		}
+		else {
+			fast_ms = cdt_ms;
+			fast_tris = cdt_tris;
+		}
+		printf(
+			"%-9s %6zu polygons  cdt %9.3f ms (%zu triangles)  direct %9.3f ms (%zu triangles)  speedup %.1fx\n",
+			names[k], polys.size(), cdt_ms, cdt_tris, fast_ms, fast_tris, cdt_ms / fast_ms
+		);
+	}
+	return 0;
+}
@@ -3,6 +3,7 @@
 
 #include "geom_utils.h"
 #include "prob_utils.h"
+#include "profiler.h"
 #include "yocto_utils.h"
 
 /**
@@ -73,6 +74,8 @@ namespace yb {
 		ygl::shape* open_window_shape = nullptr;
 		float open_windows_ratio = 0.5f; // Percentage of open windows
 		float filled_spots_ratio = 1.f; // Ratio of spots that actually have a window
+		float window_width = -1.f; // Width of the widest of the two shapes,
+		                           // computed from them if negative
 	};
 
 	enum class building_type {
@@ -81,6 +84,14 @@ namespace yb {
 		regular
 	};
 
+	// Levels of detail, from the finest to the coarsest
+	enum class building_lod {
+		full = 0,
+		no_windows, // No windows and no belts
+		footprint, // Floors merged into an extruded footprint, roof without thickness
+		box // Bounding box of the whole building
+	};
+
 	struct building_params {
 		building_type type;
 
@@ -102,10 +113,19 @@ namespace yb {
 		float width_delta_per_floor = 0.f; // How much to expand or shrink 
 		                                   // each consecutive floor,
 		                                   // as a polygon offsetting size
+		bool instanced_floors = false; // If true and width_delta_per_floor is 0, a single
+		                               // floor and belt shape are made and instanced
+		                               // once per floor
+		building_lod lod = building_lod::full; // Coarser levels draw the same random numbers,
+		                                       // so all levels have the same structure
 		std::string id = "";
 		ygl::vec3f color1 = { 1,1,1 };
 		ygl::vec3f color2 = { 1,1,1 };
 		ygl::rng_pcg32* rng = nullptr;
+		material_cache* mat_cache = nullptr; // If set, materials are shared among buildings
+		std::vector<instance_array>* window_arrays = nullptr; // If set, windows are added
+		                                                      // here as instance arrays
+		                                                      // instead of as instances
 
 		// Roof
 		roof_params roof_pars;
@@ -140,7 +160,7 @@ namespace yb {
 		}
 		float center_height = tanf(roof_angle)*floor_width / 2.f;
 		auto _floor_main_points = to_3d(floor_main_points);
-		ygl::shape* shp = new ygl::shape();
+		ygl::shape* shp = make_new<ygl::shape>();
 		shp->pos = yb::make_wide_line_border(floor_main_points, floor_width);
 		auto mid_point = (shp->pos[0] + shp->pos.back()) / 2.f;
 		mid_point.y += center_height;
@@ -198,7 +218,7 @@ namespace yb {
 		float roof_height,
 		float base_height = 0.f
 	) {
-		auto shp = new ygl::shape();
+		auto shp = make_new<ygl::shape>();
 		auto t = triangulate_opposite(to_3d(border), {});
 		shp->triangles = std::get<0>(t);
 		shp->pos = std::get<1>(t);
@@ -261,7 +281,7 @@ namespace yb {
 		}
 		float center_height = tanf(roof_angle)*floor_width / 2.f;
 		auto floor_border = make_wide_line_border(floor_main_points, floor_width);
-		auto shp = new ygl::shape();
+		auto shp = make_new<ygl::shape>();
 		
 		// Law of sines: 
 		//		a/sin(A) = b/sin(B) = c/sin(C), where a,b and c are the lengths
@@ -398,6 +418,96 @@ namespace yb {
 		return border;
 	}
 
+	/**
+	 * Stacks count copies of the input shapes along the y axis, the i-th one
+	 * displaced by base_height + i*step_height, into a single shape.
+	 *
+	 * If only one shape is given it is used for all levels, otherwise the
+	 * i-th shape is used for the i-th level.
+	 * The output buffers are reserved once and duplicate points are merged
+	 * with a single pass at the end.
+	 */
+	ygl::shape* __stack_shapes(
+		const std::vector<ygl::shape*>& shapes,
+		unsigned count,
+		float step_height,
+		float base_height = 0.f
+	) {
+		auto shp = make_new<ygl::shape>();
+		if (shapes.empty() || count == 0) return shp;
+		auto level_shape = [&](int i) { return shapes[shapes.size() == 1 ? 0 : i]; };
+
+		// Per-vertex data is carried if all the shapes have it
+		size_t num_pos = 0, num_quads = 0, num_triangles = 0;
+		bool has_norm = true, has_texcoord = true, has_color = true;
+		for (int i = 0; i < count; i++) {
+			auto s = level_shape(i);
+			num_pos += s->pos.size();
+			num_quads += s->quads.size();
+			num_triangles += s->triangles.size();
+			has_norm = has_norm && s->norm.size() == s->pos.size();
+			has_texcoord = has_texcoord && s->texcoord.size() == s->pos.size();
+			has_color = has_color && s->color.size() == s->pos.size();
+		}
+		shp->pos.reserve(num_pos);
+		if (has_norm) shp->norm.reserve(num_pos);
+		if (has_texcoord) shp->texcoord.reserve(num_pos);
+		if (has_color) shp->color.reserve(num_pos);
+		shp->quads.reserve(num_quads);
+		shp->triangles.reserve(num_triangles);
+
+		for (int i = 0; i < count; i++) {
+			auto s = level_shape(i);
+			int ps = shp->pos.size();
+			ygl::vec3f disp = { 0, base_height + step_height*i, 0 };
+			for (const auto& p : s->pos) shp->pos.push_back(p + disp);
+			if (has_norm) shp->norm.insert(shp->norm.end(), s->norm.begin(), s->norm.end());
+			if (has_texcoord) shp->texcoord.insert(shp->texcoord.end(), s->texcoord.begin(), s->texcoord.end());
+			if (has_color) shp->color.insert(shp->color.end(), s->color.begin(), s->color.end());
+			for (const auto& q : s->quads) shp->quads.push_back(q + ygl::vec4i{ ps,ps,ps,ps });
+			for (const auto& t : s->triangles) shp->triangles.push_back(t + ygl::vec3i{ ps,ps,ps });
+		}
+		merge_same_points(shp);
+		return shp;
+	}
+
+	/**
+	 * Makes the floors and the belts between them (the top floor has no belt).
+	 *
+	 * floor_borders holds either a single border, shared by all floors, or
+	 * one border per floor; the same holds for belt_borders. Each distinct
+	 * border is thickened once.
+	 */
+	std::tuple<ygl::shape*, ygl::shape*> make_floor_stack(
+		const std::vector<std::vector<ygl::vec2f>>& floor_borders,
+		const std::vector<std::vector<ygl::vec2f>>& belt_borders,
+		unsigned num_floors,
+		float floor_height,
+		float belt_height
+	) {
+		if (num_floors <= 0 || floor_borders.empty()) {
+			throw std::runtime_error("Invalid arguments");
+		}
+		std::vector<ygl::shape*> floors, belts;
+		floors.reserve(floor_borders.size());
+		for (const auto& b : floor_borders) floors.push_back(thicken_polygon(b, floor_height));
+		if (belt_height > 0.f) { // Belt is optional
+			auto num_belts = std::min<size_t>(belt_borders.size(), std::max<int>(num_floors - 1, 1));
+			belts.reserve(num_belts);
+			for (int i = 0; i < num_belts; i++) {
+				belts.push_back(thicken_polygon(belt_borders[i], belt_height));
+			}
+		}
+
+		auto step = floor_height + belt_height;
+		auto floor_shp = __stack_shapes(floors, num_floors, step);
+		auto belt_shp = __stack_shapes(belts, num_floors - 1, step, floor_height);
+
+		for (auto f : floors) make_delete(f);
+		for (auto b : belts) make_delete(b);
+		return { floor_shp, belt_shp };
+	}
+
 	std::tuple<ygl::shape*, ygl::shape*> __make_floors_from_border(
 		const std::vector<ygl::vec2f>& floor_border,
 		unsigned num_floors,
@@ -410,50 +520,29 @@ namespace yb {
 			belt_height < 0.f || belt_additional_width <= 0.f) {
 			throw std::runtime_error("Invalid arguments");
 		}
-		auto floor = thicken_polygon(floor_border, floor_height);
-		ygl::shape* belt = nullptr;
-		if (belt_height <= 0.f) { // Belt is optional
-			belt = new ygl::shape();
+		std::vector<std::vector<ygl::vec2f>> floor_borders = { floor_border };
+		std::vector<std::vector<ygl::vec2f>> belt_borders;
+		if (width_delta_per_floor == 0.f) {
+			if (belt_height > 0.f) {
+				belt_borders.push_back(expand_polygon(floor_border, belt_additional_width));
+			}
 		}
 		else {
-			belt = thicken_polygon(
-				expand_polygon(floor_border, belt_additional_width), 
-				belt_height
-			);
-			displace(belt->pos, { 0,floor_height,0 });
-		}
-		auto floor_shp = new ygl::shape();
-		auto belt_shp = new ygl::shape();
-		merge_shapes(floor_shp, floor);
-		for (int i = 1; i < num_floors; i++) {
-			merge_shapes(belt_shp, belt);
-			if (width_delta_per_floor == 0.f) {
-				displace(belt->pos, { 0,floor_height + belt_height,0 });
-				displace(floor->pos, { 0,floor_height + belt_height,0 });
-			}
-			else {
-				delete floor;
-				delete belt;
-				floor = thicken_polygon(
-					offset_polygon(floor_border, width_delta_per_floor*i)[0],
-					floor_height
-				);
-				belt = thicken_polygon(
-					offset_polygon(
-						floor_border,
-						belt_additional_width + width_delta_per_floor*i
-					)[0],
-					belt_height
-				);
-				displace(floor->pos, { 0,(floor_height + belt_height)*i,0 });
-				displace(belt->pos, { 0,(floor_height + belt_height)*i + floor_height,0 });
+			// All floors' and belts' offsets with a single offsetter
+			std::vector<float> deltas;
+			for (int i = 1; i < num_floors; i++) deltas.push_back(width_delta_per_floor*i);
+			if (belt_height > 0.f) {
+				for (int i = 0; i < num_floors - 1; i++) {
+					deltas.push_back(belt_additional_width + width_delta_per_floor*i);
+				}
 			}
-			merge_shapes(floor_shp, floor);
+			auto offsets = offset_polygon(floor_border, deltas);
+			for (int i = 0; i < num_floors - 1; i++) floor_borders.push_back(offsets[i][0]);
+			for (int i = num_floors - 1; i < offsets.size(); i++) belt_borders.push_back(offsets[i][0]);
 		}
-
-		delete floor;
-		delete belt;
-		return { floor_shp, belt_shp };
+		return make_floor_stack(
+			floor_borders, belt_borders, num_floors, floor_height, belt_height
+		);
 	}
 
 	std::tuple<ygl::shape*, ygl::shape*> make_floors_from_main_points(
@@ -470,59 +559,20 @@ namespace yb {
 			throw std::runtime_error("Invalid arguments");
 		}
 
-		// This function is mostly copy-pasted from __make_floors_from_border
-		// Will fix later :)
-
-		auto floor_border = to_2d(make_wide_line_border(floor_main_points, floor_width));
-		auto floor = thicken_polygon(floor_border, floor_height);
-		ygl::shape* belt = nullptr;
-		if (belt_height <= 0.f) { // Belt is optional
-			belt = new ygl::shape();
-		}
-		else {
-			belt = thicken_polygon(
-				expand_polygon(floor_border, belt_additional_width),
-				belt_height
-			);
-			displace(belt->pos, { 0,floor_height,0 });
-		}
-
-		auto floor_shp = new ygl::shape();
-		auto belt_shp = new ygl::shape();
-		merge_shapes(floor_shp, floor);
-		for (int i = 1; i < num_floors; i++) {
-			merge_shapes(belt_shp, belt);
-			if (width_delta_per_floor == 0.f) {
-				displace(belt->pos, { 0,floor_height + belt_height,0 });
-				displace(floor->pos, { 0,floor_height + belt_height,0 });
+		std::vector<std::vector<ygl::vec2f>> floor_borders, belt_borders;
+		auto num_borders = width_delta_per_floor == 0.f ? 1 : num_floors;
+		for (int i = 0; i < num_borders; i++) {
+			floor_borders.push_back(to_2d(make_wide_line_border(
+				floor_main_points,
+				floor_width + width_delta_per_floor*i
+			)));
+			if (belt_height > 0.f) {
+				belt_borders.push_back(expand_polygon(floor_borders.back(), belt_additional_width));
 			}
-			else {
-				delete floor;
-				delete belt;
-				auto floor_border = to_2d(make_wide_line_border(
-					floor_main_points, 
-					floor_width + width_delta_per_floor*i
-				));
-				floor = thicken_polygon(
-					floor_border,
-					floor_height
-				);
-				belt = thicken_polygon(
-					offset_polygon(
-						floor_border,
-						belt_additional_width
-					)[0],
-					belt_height
-				);
-				displace(floor->pos, { 0,(floor_height + belt_height)*i,0 });
-				displace(belt->pos, { 0,(floor_height + belt_height)*i + floor_height,0 });
-			}
-			merge_shapes(floor_shp, floor);
 		}
-
-		delete floor;
-		delete belt;
-		return { floor_shp, belt_shp };
+		return make_floor_stack(
+			floor_borders, belt_borders, num_floors, floor_height, belt_height
+		);
 	}
 
 	std::tuple<ygl::shape*, ygl::shape*> make_floors_from_regular(
@@ -536,69 +586,99 @@ namespace yb {
 		float belt_additional_width,
 		float width_delta_per_floor = 0.f
 	) {
-		auto floor_border = make_regular_polygon(
-			num_sides,
-			radius,
-			base_angle
+		if (radius <= 0.f || num_floors <= 0 || floor_height <= 0.f ||
+			belt_height < 0.f || belt_additional_width < 0.f) {
+			throw std::runtime_error("Invalid arguments");
+		}
+
+		std::vector<std::vector<ygl::vec2f>> floor_borders, belt_borders;
+		auto num_borders = width_delta_per_floor == 0.f ? 1 : num_floors;
+		for (int i = 0; i < num_borders; i++) {
+			auto floor_border = make_regular_polygon(
+				num_sides, radius + width_delta_per_floor*i, base_angle
+			);
+			for (auto& p : floor_border) p += floor_center;
+			floor_borders.push_back(floor_border);
+			if (belt_height > 0.f) {
+				belt_borders.push_back(expand_polygon(floor_border, belt_additional_width));
+			}
+		}
+		return make_floor_stack(
+			floor_borders, belt_borders, num_floors, floor_height, belt_height
 		);
-		for (auto& p : floor_border) p += floor_center;
+	}
 
-		// This function is mostly copy-pasted from __make_floors_from_border
-		// Will fix later :)
+	auto& make_floors_from_border = __make_floors_from_border;
 
-		auto floor = thicken_polygon(floor_border, floor_height);
-		ygl::shape* belt = nullptr;
-		if (belt_height <= 0.f) { // Belt is optional
-			belt = new ygl::shape();
-		}
-		else {
-			belt = thicken_polygon(
-				expand_polygon(floor_border, belt_additional_width),
-				belt_height
+	/**
+	 * Returns the border of the i-th floor of a building
+	 */
+	std::vector<ygl::vec2f> make_floor_border_from_params(
+		const building_params& params,
+		int floor = 0
+	) {
+		std::vector<ygl::vec2f> border;
+		switch (params.type) {
+		case building_type::main_points:
+			border = to_2d(make_wide_line_border(
+				params.floor_main_points,
+				params.floor_width + params.width_delta_per_floor*floor
+				)
+			);
+			break;
+		case building_type::border:
+			border = floor == 0 || params.width_delta_per_floor == 0.f ?
+				params.floor_border :
+				offset_polygon(params.floor_border, params.width_delta_per_floor*floor)[0];
+			break;
+		case building_type::regular:
+			border = make_regular_polygon(
+				params.num_sides,
+				params.radius + params.width_delta_per_floor*floor,
+				params.reg_base_angle
 			);
-			displace(belt->pos, { 0,floor_height,0 });
+			for (auto& p : border) p += params.floor_center;
+			break;
+		default:
+			throw std::runtime_error("Invalid building type");
 		}
+		return border;
+	}
 
-		auto floor_shp = new ygl::shape();
-		auto belt_shp = new ygl::shape();
-		merge_shapes(floor_shp, floor);
-		for (int i = 1; i < num_floors; i++) {
-			merge_shapes(belt_shp, belt);
-			if (width_delta_per_floor == 0.f) {
-				displace(belt->pos, { 0,floor_height + belt_height,0 });
-				displace(floor->pos, { 0,floor_height + belt_height,0 });
+	/**
+	 * Returns the borders of all the floors of a building.
+	 *
+	 * Same as calling make_floor_border_from_params for each floor, but border
+	 * buildings are offset with a single call and buildings that don't widen
+	 * compute their border only once.
+	 */
+	std::vector<std::vector<ygl::vec2f>> make_floor_borders_from_params(
+		const building_params& params
+	) {
+		std::vector<std::vector<ygl::vec2f>> borders;
+		borders.reserve(params.num_floors);
+		if (params.num_floors == 0) return borders;
+		borders.push_back(make_floor_border_from_params(params, 0));
+		if (params.width_delta_per_floor == 0.f) {
+			borders.resize(params.num_floors, borders[0]);
+		}
+		else if (params.type == building_type::border) {
+			std::vector<float> deltas;
+			for (int i = 1; i < params.num_floors; i++) {
+				deltas.push_back(params.width_delta_per_floor*i);
 			}
-			else {
-				delete floor;
-				delete belt;
-				auto floor_border = make_regular_polygon(
-					num_sides, radius+width_delta_per_floor*i, base_angle
-				);
-				for (auto& p : floor_border) p += floor_center;
-				floor = thicken_polygon(
-					floor_border,
-					floor_height
-				);
-				belt = thicken_polygon(
-					offset_polygon(
-						floor_border,
-						belt_additional_width
-					)[0],
-					belt_height
-				);
-				displace(floor->pos, { 0,(floor_height + belt_height)*i,0 });
-				displace(belt->pos, { 0,(floor_height + belt_height)*i + floor_height,0 });
+			for (auto& offsets : offset_polygon(params.floor_border, deltas)) {
+				borders.push_back(offsets[0]);
 			}
-			merge_shapes(floor_shp, floor);
 		}
-
-		delete floor;
-		delete belt;
-		return { floor_shp, belt_shp };
+		else {
+			for (int i = 1; i < params.num_floors; i++) {
+				borders.push_back(make_floor_border_from_params(params, i));
+			}
+		}
+		return borders;
 	}
 
-	auto& make_floors_from_border = __make_floors_from_border;
-
 	// Walls
 
 	/**
@@ -620,9 +700,10 @@ namespace yb {
 			);
 		}
 		else {
-			auto ext_border = expand_polygon(points, thickness / 2.f);
+			auto borders = offset_polygon(points, { thickness / 2.f, -thickness / 2.f });
 			// Assuming only one output polygon
-			auto int_border = offset_polygon(points, -thickness / 2.f)[0];
+			auto ext_border = borders[0][0];
+			auto int_border = borders[1][0];
 			std::reverse(int_border.begin(), int_border.end());
 			shp = thicken_polygon(
 				ext_border, height, { int_border }
@@ -645,53 +726,55 @@ namespace yb {
 	}
 
 	/**
-	 * Makes all the windows for a building.
-	 *
-	 * Since it needs a different material than the rest of the building,
-	 * the shape (material included) is taken as input and a vector of instances
-	 * (one for each window) is returned. The shapes are assumed to be centered around
-	 * {0,0,0} (on all three dimensions!).
+	 * Returns the width of the widest of the two window shapes
 	 */
-	std::vector<ygl::instance*> make_windows(
-		const building_params& params
-	) {
+	float get_window_width(const ygl::shape* open_shp, const ygl::shape* closed_shp) {
+		return std::max(get_size(open_shp).x, get_size(closed_shp).x);
+	}
+
+	/**
+	 * Returns the window width of the parameters, from the cache if set
+	 */
+	float get_window_width(const windows_params& win_pars) {
+		return win_pars.window_width >= 0.f ?
+			win_pars.window_width :
+			get_window_width(win_pars.open_window_shape, win_pars.closed_window_shape);
+	}
+
+	// Windows' placement on a side of a floor
+	struct facade_side {
+		int floor = 0;
+		ygl::vec2f start = { 0,0 }; // Center of the first window
+		ygl::vec2f dir = { 0,0 }; // Side versor
+		float angle = 0.f; // Side angle
+		float step = 0.f; // Distance between consecutive windows' centers
+		int count = 0; // Number of window spots
+	};
+
+	// Windows' placement on all the sides of a building's floors
+	struct facade_layout {
+		float window_width = 0.f;
+		std::vector<facade_side> sides; // Only sides with at least one spot
+		int num_spots = 0;
+	};
+
+	/**
+	 * Computes where the windows of a building go, without deciding which
+	 * spots are actually filled
+	 */
+	facade_layout make_facade_layout(const building_params& params) {
 		check_win_info(params.win_pars);
 
-		int win_id = 0; // Windows's unique id for instances' names
-		std::vector<ygl::instance*> windows;
-		for (int i = 0; i < params.num_floors; i++) {
-			std::vector<ygl::vec2f> border;
-			switch (params.type) {
-			case building_type::main_points:
-				border = to_2d(make_wide_line_border(
-					params.floor_main_points, 
-					params.floor_width + params.width_delta_per_floor*i
-					)
-				);
-				break;
-			case building_type::border: 
-				border = offset_polygon(params.floor_border, params.width_delta_per_floor*i)[0]; 
-				break;
-			case building_type::regular:
-				border = make_regular_polygon(
-					params.num_sides, 
-					params.radius + params.width_delta_per_floor*i, 
-					params.reg_base_angle
-				);
-				for (auto& p : border) p += params.floor_center;
-				break;
-			default:
-				throw std::runtime_error("Invalid building type");
-			}
-			for_sides(border, [&](const ygl::vec2f& p1, const ygl::vec2f& p2) {
+		facade_layout layout;
+		auto w = get_window_width(params.win_pars); // Window's width
+		layout.window_width = w;
+		auto borders = make_floor_borders_from_params(params);
+		for (int i = 0; i < borders.size(); i++) {
+			for_sides(borders[i], [&](const ygl::vec2f& p1, const ygl::vec2f& p2) {
 				auto side = p2 - p1;
 				auto eps = params.win_pars.windows_distance_from_edges; // Min distance between window and corner
 				auto W = ygl::length(side); // Side length
 
-				auto w = get_size(params.win_pars.closed_window_shape).x; // Window's width
-				if (get_size(params.win_pars.open_window_shape).x > w)
-					w = get_size(params.win_pars.open_window_shape).x;
-
 				auto s = params.win_pars.windows_distance;
 				int n; // Number of windows fitting on this side within the given constraints
 				if (w + 2 * eps >= W) n = 0;
@@ -702,44 +785,104 @@ namespace yb {
 				s = (W - 2 * eps - n*w) / (n - 1);
 				if (n == 1) eps = W / 2.f; // Special case: 1 window is on the center
 
-				auto dir = ygl::normalize(side); // Side versor
-				for (int j = 0; j < n; j++) { // n windows per size
-					auto win_center_xz = p1 + dir*(eps + w / 2.f + (w + s)*j);
-					// Keep around f_p_s percent of windows
-					if (!bernoulli(*params.rng, params.win_pars.filled_spots_ratio))
-						continue;
-
-					auto win_center_y =
-						params.floor_height / 2.f +
-						(params.floor_height + params.belt_height)*i;
-
-					auto win_inst = new ygl::instance();
-					win_inst->name = params.win_pars.name + "_" + std::to_string(win_id++);
-					win_inst->shp =
-						bernoulli(*params.rng, params.win_pars.open_windows_ratio) ?
-						params.win_pars.open_window_shape :
-						params.win_pars.closed_window_shape;
-					win_inst->frame.o = to_3d(win_center_xz, win_center_y);
-					rotate_y(win_inst->frame.x, get_angle(side));
-					rotate_y(win_inst->frame.z, get_angle(side));
-					windows.push_back(win_inst);
-				}
+				facade_side fs;
+				fs.floor = i;
+				fs.dir = ygl::normalize(side);
+				fs.start = p1 + fs.dir*(eps + w / 2.f);
+				fs.angle = get_angle(side);
+				fs.step = w + s;
+				fs.count = n;
+				layout.sides.push_back(fs);
+				layout.num_spots += n;
 			});
 		}
+		return layout;
+	}
+
+	/**
+	 * Makes all the windows for a building, as one instance array for each
+	 * side of each floor.
+	 *
+	 * The shapes are assumed to be centered around {0,0,0} (on all three
+	 * dimensions!). Array slots are numbered so that, once expanded, the
+	 * windows are the same (names included) made by make_windows.
+	 */
+	std::vector<instance_array> make_window_arrays(
+		const building_params& params,
+		const facade_layout& layout
+	) {
+		int win_id = 0; // Windows's unique id for instances' names
+		std::vector<instance_array> arrays;
+		arrays.reserve(layout.sides.size());
+		for (const auto& fs : layout.sides) {
+			auto win_center_y =
+				params.floor_height / 2.f +
+				(params.floor_height + params.belt_height)*fs.floor;
+
+			instance_array arr;
+			arr.name = params.win_pars.name;
+			arr.first_id = win_id;
+			arr.frame.o = to_3d(fs.start, win_center_y);
+			rotate_y(arr.frame.x, fs.angle);
+			rotate_y(arr.frame.z, fs.angle);
+			arr.step = to_3d(fs.dir*fs.step, 0);
+			arr.count = fs.count;
+			arr.shp_on = params.win_pars.open_window_shape;
+			arr.shp_off = params.win_pars.closed_window_shape;
+			arr.present.resize(fs.count);
+			arr.on.resize(fs.count);
+			for (int j = 0; j < fs.count; j++) { // n windows per size
+				// Keep around f_p_s percent of windows
+				arr.present[j] = bernoulli(*params.rng, params.win_pars.filled_spots_ratio);
+				if (!arr.present[j]) continue;
+				arr.on[j] = bernoulli(*params.rng, params.win_pars.open_windows_ratio);
+				win_id++;
+			}
+			arrays.push_back(std::move(arr));
+		}
+		return arrays;
+	}
+
+	std::vector<instance_array> make_window_arrays(
+		const building_params& params
+	) {
+		profile_scope prof(profile_stage::windows);
+		return make_window_arrays(params, make_facade_layout(params));
+	}
+
+	/**
+	 * Makes all the windows for a building.
+	 *
+	 * Since it needs a different material than the rest of the building,
+	 * the shape (material included) is taken as input and a vector of instances
+	 * (one for each window) is returned. The shapes are assumed to be centered around
+	 * {0,0,0} (on all three dimensions!).
+	 */
+	std::vector<ygl::instance*> make_windows(
+		const building_params& params
+	) {
+		profile_scope prof(profile_stage::windows);
+		auto layout = make_facade_layout(params);
+		std::vector<ygl::instance*> windows;
+		windows.reserve(layout.num_spots);
+		for (const auto& arr : make_window_arrays(params, layout)) {
+			auto insts = expand_instance_array(arr);
+			windows.insert(windows.end(), insts.begin(), insts.end());
+		}
 		return windows;
 	}
 
 	std::tuple<ygl::shape*, ygl::shape*> make_test_windows(
 		const std::string& name_open, const std::string& name_closed
 	) {
-		auto regwnd_shp = new ygl::shape();
+		auto regwnd_shp = make_new<ygl::shape>();
 		std::tie(regwnd_shp->quads, regwnd_shp->pos) = make_parallelepidedon(1.6f, 1.f, .10f);
 		set_shape_normals(regwnd_shp);
 		center_points(regwnd_shp->pos);
 		regwnd_shp->mat = make_material(name_open + "_mat", { 0.8f,0.8f,1.f }, nullptr, { 0.8f,0.8f,0.8f });
 		regwnd_shp->name = name_open + "_shape";
 
-		auto regwnd_close_shp = new ygl::shape();
+		auto regwnd_close_shp = make_new<ygl::shape>();
 		std::tie(regwnd_close_shp->quads, regwnd_close_shp->pos) =
 			make_parallelepidedon(1.f, 1.f, .10f);
 		center_points(regwnd_close_shp->pos);
@@ -756,7 +899,8 @@ namespace yb {
 		ygl::shape *closed_window_shape,
 		std::string id
 	) {
-		building_params *params = new building_params();
+		profile_scope prof(profile_stage::building_params);
+		building_params *params = make_new<building_params>();
 		params->type = choose_random_weighted(
 			rng,
 			std::vector<building_type>{
@@ -867,6 +1011,7 @@ namespace yb {
 	std::tuple<ygl::shape*, ygl::shape*> make_floors_from_params(
 		const building_params& params
 	) {
+		profile_scope prof(profile_stage::floors);
 		switch (params.type) {
 		case building_type::main_points:
 			return make_floors_from_main_points(
@@ -892,7 +1037,41 @@ namespace yb {
 		}
 	}
 
+	/**
+	 * Makes the shapes of a single floor and of the belt above it, to be
+	 * instanced on each floor of a building with no per-floor widening.
+	 *
+	 * The belt shape is empty if the building has a single floor or no belts.
+	 */
+	std::tuple<ygl::shape*, ygl::shape*> make_floor_and_belt_from_params(
+		const building_params& params
+	) {
+		profile_scope prof(profile_stage::floors);
+		if (params.width_delta_per_floor != 0.f) {
+			throw std::runtime_error("Floors can't be instanced");
+		}
+		auto border = make_floor_border_from_params(params);
+		auto floor = thicken_polygon(border, params.floor_height);
+		auto floor_shp = __stack_shapes({ floor }, 1, 0.f);
+		make_delete(floor);
+
+		ygl::shape* belt_shp = nullptr;
+		if (params.num_floors > 1 && params.belt_height > 0.f) {
+			auto belt = thicken_polygon(
+				expand_polygon(border, params.belt_additional_width),
+				params.belt_height
+			);
+			belt_shp = __stack_shapes({ belt }, 1, 0.f, params.floor_height);
+			make_delete(belt);
+		}
+		else {
+			belt_shp = make_new<ygl::shape>();
+		}
+		return { floor_shp, belt_shp };
+	}
+
 	std::tuple<ygl::shape*, ygl::shape*> make_roof_from_params(const building_params& params) {
+		profile_scope prof(profile_stage::roof);
 		const auto& r_pars = params.roof_pars; // Shorter alias
 		auto base_height = get_building_height(
 			params.num_floors, params.floor_height, params.belt_height
@@ -906,7 +1085,7 @@ namespace yb {
 
 		switch (r_pars.type) {
 		case roof_type::none:
-			r_shp = new ygl::shape(); // Empty shape
+			r_shp = make_new<ygl::shape>(); // Empty shape
 			break;
 		case roof_type::crossgabled: 
 			if (params.type != building_type::main_points) {
@@ -974,7 +1153,7 @@ namespace yb {
 		default:
 			throw std::runtime_error("Invalid roof type");
 		}
-		return { r_shp, t_shp != nullptr ? t_shp : new ygl::shape() };
+		return { r_shp, t_shp != nullptr ? t_shp : make_new<ygl::shape>() };
 	}
 
 	// Definition later
@@ -1028,10 +1207,16 @@ namespace yb {
 		tower_params.roof_pars.type = roof_type::pyramid;
 		tower_params.tower_prob = 0.f;
 		 
+		auto num_arrays = params.window_arrays ? params.window_arrays->size() : 0;
 		auto tower_insts = make_building(tower_params);
 		for (auto ti : tower_insts) {
 			translate(ti, to_3d(tower_floor_center));
 		}
+		if (params.window_arrays) {
+			for (auto i = num_arrays; i < params.window_arrays->size(); i++) {
+				translate((*params.window_arrays)[i], to_3d(tower_floor_center));
+			}
+		}
 		return tower_insts;
 	}
 
@@ -1067,38 +1252,190 @@ namespace yb {
 		return mainpts_subs;
 	}
 
+	/**
+	 * Makes the instances of a building's floors and, if with_belts, belts
+	 */
+	std::vector<ygl::instance*> __make_floors_and_belts(
+		const building_params& params,
+		bool with_belts
+	) {
+		std::vector<ygl::instance*> instances;
+		if (params.instanced_floors && params.width_delta_per_floor == 0.f) {
+			// One floor and one belt shape, shared by an instance per floor
+			auto h_shp = make_floor_and_belt_from_params(params);
+			auto floor_inst = make_instance(
+				params.id + "_h1",
+				std::get<0>(h_shp),
+				get_material(params.mat_cache, params.color1, nullptr, { 0,0,0 })
+			);
+			instances += floor_inst;
+			auto floor_step = params.floor_height + params.belt_height;
+			for (int i = 1; i < params.num_floors; i++) {
+				auto inst = make_instance(floor_inst->name + std::to_string(i), floor_inst->shp);
+				translate(inst, { 0, floor_step*i, 0 });
+				instances += inst;
+			}
+			if (!with_belts) {
+				make_delete(std::get<1>(h_shp));
+				return instances;
+			}
+			auto belt_inst = make_instance(
+				params.id + "_h2",
+				std::get<1>(h_shp),
+				get_material(params.mat_cache, params.color2, nullptr, { 0,0,0 })
+			);
+			instances.insert(instances.begin() + 1, belt_inst);
+			for (int i = 1; i < int(params.num_floors) - 1; i++) {
+				auto inst = make_instance(belt_inst->name + std::to_string(i), belt_inst->shp);
+				translate(inst, { 0, floor_step*i, 0 });
+				instances += inst;
+			}
+		}
+		else {
+			auto h_shp = make_floors_from_params(params);
+			instances += make_instance(
+				params.id + "_h1",
+				std::get<0>(h_shp),
+				get_material(params.mat_cache, params.color1, nullptr, { 0,0,0 })
+			);
+			if (!with_belts) {
+				make_delete(std::get<1>(h_shp));
+				return instances;
+			}
+			instances += make_instance(
+				params.id + "_h2",
+				std::get<1>(h_shp),
+				get_material(params.mat_cache, params.color2, nullptr, { 0,0,0 })
+			);
+		}
+		return instances;
+	}
+
+	/**
+	 * Makes the widest floor's border extruded to the whole height of the
+	 * building
+	 */
+	ygl::shape* make_footprint_from_params(const building_params& params) {
+		profile_scope prof(profile_stage::floors);
+		auto widest_floor = params.width_delta_per_floor > 0.f ? params.num_floors - 1 : 0;
+		auto shp = thicken_polygon(
+			make_floor_border_from_params(params, widest_floor),
+			get_building_height(params.num_floors, params.floor_height, params.belt_height)
+		);
+		return shp;
+	}
+
+	/**
+	 * Draws the same random numbers as making the building's windows, for
+	 * the levels of detail that leave them out
+	 */
+	void __skip_windows(const building_params& params) {
+		for (const auto& fs : make_facade_layout(params).sides) {
+			for (int j = 0; j < fs.count; j++) {
+				if (bernoulli(*params.rng, params.win_pars.filled_spots_ratio)) {
+					bernoulli(*params.rng, params.win_pars.open_windows_ratio);
+				}
+			}
+		}
+	}
+
+	/**
+	 * Makes the bounding box of the building, including recursive buildings
+	 * and towers, as a single instance
+	 */
+	std::vector<ygl::instance*> __make_building_box(
+		const building_params& params,
+		float base_height
+	) {
+		// The box encloses the footprint level, which has the same extent
+		auto fp_params = params;
+		fp_params.lod = building_lod::footprint;
+		fp_params.window_arrays = nullptr;
+		auto bbox = ygl::invalid_bbox3f;
+		std::unordered_set<ygl::shape*> shapes;
+		for (auto inst : make_building(fp_params, base_height)) {
+			for (const auto& p : inst->shp->pos) bbox += ygl::transform_point(inst->frame, p);
+			shapes.insert(inst->shp);
+			make_delete(inst);
+		}
+		for (auto shp : shapes) {
+			if (!params.mat_cache) make_delete(shp->mat);
+			make_delete(shp);
+		}
+
+		auto shp = make_new<ygl::shape>();
+		auto size = bbox.max - bbox.min;
+		std::tie(shp->quads, shp->pos) = make_parallelepidedon(
+			size.x, size.y, size.z, bbox.min.x, bbox.min.y, bbox.min.z
+		);
+		return { make_instance(
+			params.id + "_box",
+			shp,
+			get_material(params.mat_cache, params.color1, nullptr, { 0,0,0 })
+		) };
+	}
+
 	std::vector<ygl::instance*> make_building(
 		const building_params& params,
 		float base_height
 	) {
+		if (params.lod == building_lod::box) return __make_building_box(params, base_height);
+
 		std::vector<ygl::instance*> instances;
 		
-		auto h_shp = make_floors_from_params(params);
-		instances += make_instance(
-			params.id + "_h1",
-			std::get<0>(h_shp),
-			make_material("", params.color1, nullptr, { 0,0,0 })
-		);
-		instances += make_instance(
-			params.id + "_h2",
-			std::get<1>(h_shp),
-			make_material("", params.color2, nullptr, { 0,0,0 })
-		);
+		switch (params.lod) {
+		case building_lod::full:
+			instances += __make_floors_and_belts(params, true);
+			break;
+		case building_lod::no_windows: {
+			// Floors stretched over the belts, keeping the building's height
+			auto floors_params = params;
+			floors_params.floor_height =
+				get_building_height(params.num_floors, params.floor_height, params.belt_height) /
+				params.num_floors;
+			floors_params.belt_height = 0.f;
+			instances += __make_floors_and_belts(floors_params, false);
+			break;
+		}
+		default:
+			instances += make_instance(
+				params.id + "_h1",
+				make_footprint_from_params(params),
+				get_material(params.mat_cache, params.color1, nullptr, { 0,0,0 })
+			);
+			break;
+		}
 
 		auto r_shp = make_roof_from_params(params);
 		instances += make_instance(
 			params.id + "_rr",
 			std::get<0>(r_shp),
-			make_material("", params.roof_pars.color1, nullptr, { 0,0,0 })
-		);
-		instances += make_instance(
-			params.id + "_rt",
-			std::get<1>(r_shp),
-			make_material("", params.roof_pars.color2, nullptr, { 0,0,0 })
+			get_material(params.mat_cache, params.roof_pars.color1, nullptr, { 0,0,0 })
 		);
+		if (params.lod == building_lod::footprint) {
+			make_delete(std::get<1>(r_shp));
+		}
+		else {
+			instances += make_instance(
+				params.id + "_rt",
+				std::get<1>(r_shp),
+				get_material(params.mat_cache, params.roof_pars.color2, nullptr, { 0,0,0 })
+			);
+		}
 		
-		auto w_insts = make_windows(params);
-		instances.insert(instances.end(), w_insts.begin(), w_insts.end());
+		if (params.lod != building_lod::full) {
+			__skip_windows(params);
+		}
+		else if (params.window_arrays) {
+			for (auto& arr : make_window_arrays(params)) {
+				translate(arr, ygl::vec3f{ 0, base_height, 0 });
+				params.window_arrays->push_back(std::move(arr));
+			}
+		}
+		else {
+			auto w_insts = make_windows(params);
+			instances.insert(instances.end(), w_insts.begin(), w_insts.end());
+		}
 
 		for (auto i : instances) {
 			translate(i, ygl::vec3f{ 0, base_height, 0 });
@@ -1133,6 +1470,14 @@ namespace yb {
 			);
 			rec_params->reg_base_angle = params.reg_base_angle;
 			rec_params->tower_prob = 0.f;
+			rec_params->instanced_floors = params.instanced_floors;
+			rec_params->lod = params.lod;
+			rec_params->mat_cache = params.mat_cache;
+			rec_params->window_arrays = params.window_arrays;
+			if (rec_params->win_pars.open_window_shape == params.win_pars.open_window_shape &&
+				rec_params->win_pars.closed_window_shape == params.win_pars.closed_window_shape) {
+				rec_params->win_pars.window_width = params.win_pars.window_width;
+			}
 			
 			// Color homogeneity
 			rec_params->color1 = params.color1;
@@ -0,0 +1,415 @@
+#ifndef CITY_UTILS_H
+#define CITY_UTILS_H
+
+#include <algorithm>
+#include <cmath>
+#include <string>
+#include <unordered_set>
+#include <vector>
+
+#include "yocto\yocto_gl.h"
+
+#include "arena.h"
+#include "building_utils.h"
+#include "profiler.h"
+#include "yocto_utils.h"
+
+namespace yb {
+
+	/**
+	 * Parameters of a city: a square grid of random buildings
+	 */
+	struct city_params {
+		int buildings_per_side = 14;
+		float space_between = 70.f;
+		int seed = 0; // Each building draws from the PCG stream (seed, building index)
+		bool instanced_floors = false;
+		ygl::shape* open_window_shape = nullptr;
+		ygl::shape* closed_window_shape = nullptr;
+		float window_width = -1.f; // As in windows_params
+		float spare_slots = 0.5f; // Extra instance slots for each building of a yb::city,
+		                          // as a fraction of its instances
+	};
+
+	/**
+	 * Returns where the i-th building of the city is placed
+	 */
+	ygl::vec3f get_building_position(const city_params& pars, int i) {
+		auto start_pos = pars.space_between*(pars.buildings_per_side - 1) / 2.f;
+		return {
+			-start_pos + pars.space_between * (i / pars.buildings_per_side) + pars.space_between / 2.f*(i % 2),
+			0,
+			-start_pos + pars.space_between * (i % pars.buildings_per_side)
+		};
+	}
+
+	/**
+	 * Picks the level of detail of a building seen from the given distance:
+	 * full up to lod_distance, then one level coarser each time the distance
+	 * doubles. Always full if lod_distance isn't positive.
+	 */
+	building_lod select_building_lod(float distance, float lod_distance) {
+		if (lod_distance <= 0.f) return building_lod::full;
+		auto lod = 0;
+		for (auto d = lod_distance; distance > d && lod < int(building_lod::box); d *= 2.f) lod++;
+		return building_lod(lod);
+	}
+
+	/**
+	 * Makes the random parameters of the i-th building of the city.
+	 * rng is initialized to the building's stream and must outlive the
+	 * parameters, which keep a pointer to it.
+	 */
+	building_params* make_city_building_params(
+		const city_params& pars,
+		int i,
+		ygl::rng_pcg32& rng
+	) {
+		rng = ygl::init_rng(pars.seed, i);
+		auto params = make_rand_building_params(
+			rng, pars.open_window_shape, pars.closed_window_shape, "building" + std::to_string(i)
+		);
+		params->instanced_floors = pars.instanced_floors;
+		params->win_pars.window_width = pars.window_width;
+		return params;
+	}
+
+	/**
+	 * Makes the i-th building of the city and moves it to its place.
+	 *
+	 * The building's shapes are faceted and given normals, except for the
+	 * window shapes, which are shared by all buildings and must be
+	 * processed once by the caller.
+	 */
+	std::vector<ygl::instance*> make_city_building(
+		const city_params& pars,
+		int i,
+		const building_params& params
+	) {
+		auto insts = make_building(params);
+		// Shapes can be shared by several instances, so each is processed once
+		std::unordered_set<ygl::shape*> processed = { pars.open_window_shape, pars.closed_window_shape };
+		for (auto inst : insts) {
+			if (!processed.insert(inst->shp).second) continue;
+			profile_scope prof(profile_stage::normals);
+			ygl::facet_shape(inst->shp);
+			inst->shp->norm = ygl::compute_normals(
+				inst->shp->lines, inst->shp->triangles, inst->shp->quads, inst->shp->pos
+			);
+		}
+
+		auto displacement = get_building_position(pars, i);
+		for (auto inst : insts) translate(inst, displacement);
+		if (params.window_arrays) {
+			for (auto& arr : *params.window_arrays) translate(arr, displacement);
+		}
+		return insts;
+	}
+
+	/**
+	 * A generated city whose buildings can be changed one at a time.
+	 *
+	 * The scene only holds the buildings, whose memory is owned by the city:
+	 * each building is allocated from its own arena, so it can be released
+	 * alone, while materials are shared through a cache with its own arena.
+	 * Window shapes are the caller's.
+	 *
+	 * A building's instances take a fixed range of slots in the scene's
+	 * instances, padded with spare empty instances. A regenerated building
+	 * that fits its slots keeps the instances' indices, so the scene BVH
+	 * only needs to be refit; one that doesn't is moved to new slots at the
+	 * end, and the scene BVH is built again.
+	 */
+	struct city {
+		struct building {
+			building_params* params = nullptr;
+			ygl::rng_pcg32 rng; // State after making the random parameters,
+			                    // restored each time the building is made
+			arena* mem = nullptr;
+			std::vector<ygl::shape*> shapes; // Owned shapes (i.e. not the windows)
+			int first_slot = 0;
+			int num_slots = 0;
+			int num_instances = 0;
+		};
+
+		city_params params;
+		ygl::scene* scn = nullptr;
+		std::vector<building> buildings;
+		arena mat_mem;
+		material_cache mat_cache;
+		ygl::shape* empty_shp = nullptr; // Used by the empty slots
+		ygl::instance* empty_inst = nullptr;
+		std::vector<int> slot_buildings; // Building each slot was taken by
+		std::vector<int> slot_leaves; // Scene BVH leaf of each slot
+		std::vector<int> bvh_parents; // Parent of each scene BVH node
+
+		// Shapes and materials in the scene
+		std::unordered_set<ygl::shape*> scene_shapes;
+		std::unordered_set<ygl::material*> scene_materials;
+
+		~city();
+	};
+
+	city::~city() {
+		// Everything in the scene is either owned by the arenas or the caller's
+		if (scn) {
+			scn->instances.clear();
+			scn->shapes.clear();
+			scn->materials.clear();
+			delete scn;
+		}
+		for (auto& b : buildings) delete b.mem;
+		delete empty_inst;
+		delete empty_shp;
+	}
+
+	/**
+	 * Makes the building's instances with the given parameters, allocated
+	 * from its arena, which is cleared first (params can be the building's
+	 * own parameters, which are then kept in the new arena)
+	 */
+	std::vector<ygl::instance*> __make_city_building(city& cty, int i, building_params params) {
+		auto& b = cty.buildings[i];
+		b.shapes.clear();
+		release(b.mem);
+
+		scoped_arena arena_scope(b.mem);
+		auto rng = b.rng;
+		b.params = make_new<building_params>(params);
+		b.params->rng = &b.rng;
+		params.rng = &rng;
+		params.mat_cache = &cty.mat_cache;
+		params.window_arrays = nullptr;
+		auto insts = make_city_building(cty.params, i, params);
+
+		std::unordered_set<ygl::shape*> shapes;
+		for (auto inst : insts) {
+			if (owns(b.mem, inst->shp) && shapes.insert(inst->shp).second) {
+				b.shapes.push_back(inst->shp);
+			}
+		}
+		return insts;
+	}
+
+	/**
+	 * Adds the instances' shapes and materials that aren't in the scene yet.
+	 * Materials are named in order of appearance, as by name_cached_materials.
+	 */
+	void __add_to_city_scene(city& cty, const std::vector<ygl::instance*>& insts) {
+		for (auto inst : insts) {
+			if (cty.scene_shapes.insert(inst->shp).second) cty.scn->shapes += inst->shp;
+			auto mat = inst->shp->mat;
+			if (mat && cty.scene_materials.insert(mat).second) {
+				mat->name = "building_mat_" + std::to_string(cty.scn->materials.size());
+				cty.scn->materials += mat;
+			}
+		}
+	}
+
+	/**
+	 * Places a building's instances in its slots, filling the rest with
+	 * empty instances. If they don't fit, new slots are taken at the end.
+	 * Returns whether the slots changed.
+	 */
+	bool __set_city_building_slots(city& cty, int i, const std::vector<ygl::instance*>& insts) {
+		auto& b = cty.buildings[i];
+		auto& scn_insts = cty.scn->instances;
+		auto moved = false;
+		if (int(insts.size()) > b.num_slots) {
+			for (int s = 0; s < b.num_slots; s++) scn_insts[b.first_slot + s] = cty.empty_inst;
+			b.first_slot = scn_insts.size();
+			b.num_slots = insts.size() + int(insts.size()*cty.params.spare_slots);
+			scn_insts.resize(scn_insts.size() + b.num_slots, cty.empty_inst);
+			cty.slot_buildings.resize(scn_insts.size(), i);
+			moved = true;
+		}
+		std::copy(insts.begin(), insts.end(), scn_insts.begin() + b.first_slot);
+		std::fill(
+			scn_insts.begin() + b.first_slot + insts.size(),
+			scn_insts.begin() + b.first_slot + b.num_slots,
+			cty.empty_inst
+		);
+		b.num_instances = insts.size();
+		return moved;
+	}
+
+	/**
+	 * Makes a city. The window shapes must be already faceted and with
+	 * normals. Buildings are made in parallel if a pool is given.
+	 */
+	city* make_city(const city_params& pars, ygl::thread_pool* pool = nullptr) {
+		auto cty = new city();
+		cty->params = pars;
+		cty->scn = new ygl::scene();
+		cty->mat_cache.mem = &cty->mat_mem;
+		cty->empty_shp = new ygl::shape();
+		cty->empty_shp->name = "empty_shp";
+		cty->empty_inst = new ygl::instance();
+		cty->empty_inst->name = "empty_inst";
+		cty->empty_inst->shp = cty->empty_shp;
+
+		auto num_buildings = pars.buildings_per_side*pars.buildings_per_side;
+		cty->buildings.resize(num_buildings);
+		std::vector<std::vector<ygl::instance*>> buildings_insts(num_buildings);
+		auto make = [cty, &buildings_insts](int i) {
+			auto& b = cty->buildings[i];
+			b.mem = new arena();
+			{
+				scoped_arena arena_scope(b.mem);
+				b.params = make_city_building_params(cty->params, i, b.rng);
+			}
+			buildings_insts[i] = __make_city_building(*cty, i, *b.params);
+		};
+		if (pool) {
+			ygl::parallel_for(pool, num_buildings, make);
+		}
+		else {
+			for (int i = 0; i < num_buildings; i++) make(i);
+		}
+
+		for (int i = 0; i < num_buildings; i++) {
+			__add_to_city_scene(*cty, buildings_insts[i]);
+			__set_city_building_slots(*cty, i, buildings_insts[i]);
+		}
+		return cty;
+	}
+
+	/**
+	 * World space bounding box of the instance in the given slot. Empty
+	 * slots, as well as instances of empty shapes (e.g. some roofs) or with
+	 * non-finite frames (e.g. some windows on very short sides), are points
+	 * at their building's position: they barely enlarge the BVH nodes,
+	 * while invalid boxes would break the BVH build.
+	 */
+	ygl::bbox3f __get_slot_bbox(const city& cty, int iid) {
+		auto inst = cty.scn->instances[iid];
+		auto bbox = ygl::transform_bbox(inst->frame, inst->shp->bbox);
+		auto valid = inst->shp->bbox.min.x <= inst->shp->bbox.max.x;
+		for (int c = 0; c < 3; c++) {
+			valid = valid && std::isfinite(bbox.min[c]) && std::isfinite(bbox.max[c]);
+		}
+		if (valid) return bbox;
+		auto p = get_building_position(cty.params, cty.slot_buildings[iid]);
+		return { p, p };
+	}
+
+	/**
+	 * Builds the BVHs of the city's shapes (if do_shapes) and scene, for ray
+	 * intersection with ygl::intersect_ray
+	 */
+	void build_bvh(city& cty, bool do_shapes = true) {
+		auto scn = cty.scn;
+		if (do_shapes) {
+			ygl::build_bvh(cty.empty_shp);
+			for (auto shp : scn->shapes) ygl::build_bvh(shp);
+		}
+		for (int iid = 0; iid < int(scn->instances.size()); iid++) {
+			scn->instances[iid]->bbox = __get_slot_bbox(cty, iid);
+		}
+		if (scn->bvh) delete scn->bvh;
+		scn->bvh = ygl::build_bvh(int(scn->instances.size()), true,
+			[&cty](int iid) { return __get_slot_bbox(cty, iid); });
+
+		const auto& nodes = scn->bvh->nodes;
+		cty.bvh_parents.assign(nodes.size(), -1);
+		cty.slot_leaves.assign(scn->instances.size(), -1);
+		for (int n = 0; n < int(nodes.size()); n++) {
+			const auto& node = nodes[n];
+			for (auto k = node.start; k < node.start + node.count; k++) {
+				if (node.isleaf) cty.slot_leaves[scn->bvh->sorted_prim[k]] = n;
+				else cty.bvh_parents[k] = n;
+			}
+		}
+	}
+
+	/**
+	 * Refits the scene BVH after the given slots changed, updating only the
+	 * nodes on the paths from their leaves to the root
+	 */
+	void __refit_bvh_slots(city& cty, int first_slot, int num_slots) {
+		auto scn = cty.scn;
+		auto& nodes = scn->bvh->nodes;
+		std::unordered_set<int> leaves;
+		for (int iid = first_slot; iid < first_slot + num_slots; iid++) {
+			scn->instances[iid]->bbox = __get_slot_bbox(cty, iid);
+			leaves.insert(cty.slot_leaves[iid]);
+		}
+		// The ancestors of the leaves, each taken once
+		std::unordered_set<int> ancestors;
+		for (auto n : leaves) {
+			auto& node = nodes[n];
+			node.bbox = ygl::invalid_bbox3f;
+			for (auto k = node.start; k < node.start + node.count; k++) {
+				node.bbox += __get_slot_bbox(cty, scn->bvh->sorted_prim[k]);
+			}
+			for (auto a = cty.bvh_parents[n]; a >= 0 && ancestors.insert(a).second; a = cty.bvh_parents[a]) {}
+		}
+		// Children come after their parents in the nodes, so going by
+		// decreasing index refits each ancestor once, after its children
+		std::vector<int> sorted_ancestors(ancestors.begin(), ancestors.end());
+		std::sort(sorted_ancestors.begin(), sorted_ancestors.end(), std::greater<int>());
+		for (auto n : sorted_ancestors) {
+			auto& node = nodes[n];
+			node.bbox = ygl::invalid_bbox3f;
+			for (auto k = node.start; k < node.start + node.count; k++) node.bbox += nodes[k].bbox;
+		}
+	}
+
+	/**
+	 * Makes the i-th building again with new parameters, replacing the old
+	 * one in the scene.
+	 *
+	 * The building draws the same random numbers as when it was first made,
+	 * so it only changes as much as its parameters do. The rng, material
+	 * cache and window arrays in params are ignored.
+	 * If the scene BVH was built, the new shapes' BVHs are built and the
+	 * scene BVH is refit, unless the building outgrew its slots.
+	 */
+	void update_building(city& cty, int i, const building_params& params) {
+		auto& b = cty.buildings[i];
+		auto scn = cty.scn;
+		auto old_shapes = std::unordered_set<ygl::shape*>(b.shapes.begin(), b.shapes.end());
+		for (auto shp : old_shapes) cty.scene_shapes.erase(shp);
+
+		// The old instances and shapes are released with the old building,
+		// so they're replaced in the scene right away
+		auto insts = __make_city_building(cty, i, params);
+
+		// The new shapes take the places of the old ones, so that the order
+		// of the scene (and of saved files) only changes as much as the building
+		auto& shapes = scn->shapes;
+		size_t num_placed = 0, last = 0;
+		for (size_t k = 0; k < shapes.size(); k++) {
+			if (!old_shapes.count(shapes[k])) shapes[last++] = shapes[k];
+			else if (num_placed < b.shapes.size()) shapes[last++] = b.shapes[num_placed++];
+		}
+		shapes.resize(last);
+		shapes.insert(shapes.end(), b.shapes.begin() + num_placed, b.shapes.end());
+		cty.scene_shapes.insert(b.shapes.begin(), b.shapes.end());
+		__add_to_city_scene(cty, insts);
+		auto moved = __set_city_building_slots(cty, i, insts);
+
+		if (!scn->bvh) return;
+		for (auto shp : b.shapes) ygl::build_bvh(shp);
+		if (moved) build_bvh(cty, false);
+		else __refit_bvh_slots(cty, b.first_slot, b.num_slots);
+	}
+
+	/**
+	 * Saves the city's scene, leaving out the empty slots
+	 */
+	void save_city(
+		const std::string& filename,
+		city& cty,
+		const ygl::save_options& opts = ygl::save_options()
+	) {
+		auto scn = cty.scn;
+		auto all_insts = scn->instances;
+		scn->instances.erase(std::remove(scn->instances.begin(), scn->instances.end(), cty.empty_inst),
+			scn->instances.end());
+		ygl::save_scene(filename, scn, opts);
+		scn->instances = std::move(all_insts);
+	}
+}
+
+#endif // CITY_UTILS_H
@@ -1,11 +1,22 @@
 #ifndef GEOM_UTILS_H
 #define GEOM_UTILS_H
 
+#include <cmath>
+#include <cstdint>
+#include <unordered_map>
 #include <vector>
 
+#if defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#include <emmintrin.h>
+#define YB_SSE2 1
+#else
+#define YB_SSE2 0
+#endif
+
 #include "yocto\yocto_gl.h"
 #include "poly2tri\poly2tri\poly2tri.h"
 #include "clipper\clipper.hpp"
+#include "profiler.h"
 #include "yocto_utils.h"
 
 namespace yb {
@@ -31,13 +42,31 @@ namespace yb {
 		return { point.x, flip_y ? -point.z : point.z };
 	}
 
+	/**
+	 * Writes the 2D version of count points to out, which must have room for them
+	 */
+	void to_2d(
+		const ygl::vec3f* points, size_t count, ygl::vec2f* out, bool flip_y = true
+	) {
+		auto sz = flip_y ? -1.f : 1.f;
+		for (size_t i = 0; i < count; i++) out[i] = { points[i].x, sz*points[i].z };
+	}
+
+	/**
+	 * Overwrites out with the 2D version of the points, reusing its storage
+	 */
+	void to_2d(
+		const std::vector<ygl::vec3f>& points, std::vector<ygl::vec2f>& out, bool flip_y = true
+	) {
+		out.resize(points.size());
+		to_2d(points.data(), points.size(), out.data(), flip_y);
+	}
+
 	std::vector<ygl::vec2f> to_2d(
 		const std::vector<ygl::vec3f>& points, bool flip_y = true
 	) {
 		std::vector<ygl::vec2f> res;
-		for (const auto& p : points) {
-			res.push_back(to_2d(p,flip_y));
-		}
+		to_2d(points, res, flip_y);
 		return res;
 	}
 
@@ -49,15 +78,35 @@ namespace yb {
 		return { point.x, y, flip_z ? -point.y : point.y };
 	}
 
+	/**
+	 * Writes the 3D version of count points to out, which must have room for them
+	 */
+	void to_3d(
+		const ygl::vec2f* points, size_t count, ygl::vec3f* out,
+		float y = 0.f, bool flip_z = true
+	) {
+		auto sz = flip_z ? -1.f : 1.f;
+		for (size_t i = 0; i < count; i++) out[i] = { points[i].x, y, sz*points[i].y };
+	}
+
+	/**
+	 * Overwrites out with the 3D version of the points, reusing its storage
+	 */
+	void to_3d(
+		const std::vector<ygl::vec2f>& points, std::vector<ygl::vec3f>& out,
+		float y = 0.f, bool flip_z = true
+	) {
+		out.resize(points.size());
+		to_3d(points.data(), points.size(), out.data(), y, flip_z);
+	}
+
 	std::vector<ygl::vec3f> to_3d(
 		const std::vector<ygl::vec2f>& points, 
 		float y = 0.f,
 		bool flip_z = true
 	) {
 		std::vector<ygl::vec3f> res;
-		for (const auto& p : points) {
-			res.push_back(to_3d(p, y, flip_z));
-		}
+		to_3d(points, res, y, flip_z);
 		return res;
 	}
 
@@ -174,8 +223,9 @@ namespace yb {
 		float width,
 		bool lengthen_ends = true
 	) {
+		scoped_arena_rewind rewind; // Only temporary buffers are allocated here
 		auto half_width = width / 2.f;
-		auto _points = points; // Work-around to keep code cleaner :)
+		arena_vector<ygl::vec2f> _points(points.begin(), points.end()); // Work-around to keep code cleaner :)
 		std::vector<ygl::vec2f> vertexes;
 		if (lengthen_ends) {
 			_points[0] -= ygl::normalize(points[1] - points[0]) * half_width;
@@ -239,33 +289,69 @@ namespace yb {
 		return res;
 	}
 
+	// Clipper only uses integers, thus coordinates are scaled up by this
+	// factor before offsetting and then scaled back, to preserve the decimal part.
+	// Scaled coordinates are 64 bit, as Clipper's own
+	const unsigned offset_scale_factor = 100000;
+
 	/**
-	 * Offsets a polygon's vertexes to uniformly expand/shrink it.
+	 * Returns the calling thread's polygon offsetter, reused among calls to
+	 * keep its storage and its join setup
 	 */
-	std::vector<std::vector<ygl::vec2f>> offset_polygon(
+	ClipperLib::ClipperOffset& get_thread_offsetter() {
+		thread_local ClipperLib::ClipperOffset co;
+		return co;
+	}
+
+	/**
+	 * Offsets a polygon by several deltas at once.
+	 *
+	 * The polygon is converted to integer coordinates and added to the
+	 * clipper offsetter only once; the i-th returned element holds the
+	 * polygons offset by deltas[i].
+	 */
+	std::vector<std::vector<std::vector<ygl::vec2f>>> offset_polygon(
 		const std::vector<ygl::vec2f>& polygon,
-		float delta,
-		unsigned _scale_factor = 100000
+		const std::vector<float>& deltas,
+		unsigned _scale_factor = offset_scale_factor
 	) {
-		// Clipper only uses integer, thus we scale twice (first expand,
-		// then shrink) to preserve the decimal part.
-		int d = delta*_scale_factor;
+		profile_scope prof(profile_stage::offset_polygon);
 		ClipperLib::Path poly;
-		for (const auto& p : polygon) 
-			poly << ClipperLib::IntPoint(int(p.x*_scale_factor), int(p.y*_scale_factor));
-		ClipperLib::Paths result;
-		ClipperLib::ClipperOffset co;
+		poly.reserve(polygon.size());
+		for (const auto& p : polygon)
+			poly << ClipperLib::IntPoint(ClipperLib::cInt(p.x*_scale_factor), ClipperLib::cInt(p.y*_scale_factor));
+		auto& co = get_thread_offsetter();
+		co.Clear();
 		co.AddPath(poly, ClipperLib::jtMiter, ClipperLib::etClosedPolygon);
-		co.Execute(result, d);
-		std::vector<std::vector<ygl::vec2f>> newpolys;
-		for (const auto& path : result) {
-			std::vector<ygl::vec2f> poly;
-			for (const auto& p : path) {
-				poly.push_back(ygl::vec2f(float(p.X), float(p.Y)) / float(_scale_factor));
+		std::vector<std::vector<std::vector<ygl::vec2f>>> res;
+		res.reserve(deltas.size());
+		ClipperLib::Paths result;
+		for (auto delta : deltas) {
+			co.Execute(result, ClipperLib::cInt(delta*_scale_factor));
+			res.emplace_back();
+			res.back().reserve(result.size());
+			for (const auto& path : result) {
+				std::vector<ygl::vec2f> newpoly;
+				newpoly.reserve(path.size());
+				for (const auto& p : path) {
+					newpoly.push_back(ygl::vec2f(float(p.X), float(p.Y)) / float(_scale_factor));
+				}
+				res.back().push_back(std::move(newpoly));
 			}
-			newpolys.push_back(poly);
 		}
-		return newpolys;
+		co.Clear();
+		return res;
+	}
+
+	/**
+	 * Offsets a polygon's vertexes to uniformly expand/shrink it.
+	 */
+	std::vector<std::vector<ygl::vec2f>> offset_polygon(
+		const std::vector<ygl::vec2f>& polygon,
+		float delta,
+		unsigned _scale_factor = offset_scale_factor
+	) {
+		return std::move(offset_polygon(polygon, std::vector<float>{ delta }, _scale_factor)[0]);
 	}
 
 	/**
@@ -275,63 +361,312 @@ namespace yb {
 	std::vector<ygl::vec2f> expand_polygon(
 		const std::vector<ygl::vec2f>& polygon,
 		float delta,
-		unsigned _scale_factor = 10000
+		unsigned _scale_factor = offset_scale_factor
 	) {
 		if (delta < 0.f) throw std::runtime_error("Invalid arguments");
 		return offset_polygon(polygon, delta, _scale_factor)[0];
 	}
 
 	/**
-	* Triangulates an arbitrary shape.
-	* Holes must be given in clockwise order
-	*/
+	 * Reusable poly2tri triangulation state.
+	 *
+	 * Points, edges, triangles and advancing front nodes come from a pool
+	 * that is recycled on each call instead of reallocated, so its memory is
+	 * bounded by the largest polygon triangulated. Not thread safe, each
+	 * thread should use its own (see get_thread_triangulator).
+	 */
+	struct triangulator {
+		p2t::SweepPool pool;
+		p2t::SweepContext context;
+		p2t::Sweep sweep;
+		std::vector<p2t::Point*> polyline;
+		std::vector<p2t::Point*> hole;
+		std::vector<p2t::Point*> points; // Border and holes' points, in input order
+		std::unordered_map<const p2t::Point*, int> point_ids; // Point -> index in points
+
+		triangulator() : context(pool) {}
+		triangulator(const triangulator&) = delete;
+		triangulator& operator=(const triangulator&) = delete;
+	};
+
+	/**
+	 * Returns the calling thread's triangulator
+	 */
+	triangulator& get_thread_triangulator() {
+		thread_local triangulator trg;
+		return trg;
+	}
+
+	// Runs the triangulation, the triangles are valid until trg's next use
+	std::vector<p2t::Triangle*> __triangulate(
+		triangulator& trg,
+		const std::vector<ygl::vec2f>& border,
+		const std::vector<std::vector<ygl::vec2f>>& holes
+	) {
+		// Code adapted from https://github.com/greenm01/poly2tri/blob/master/testbed/main.cc
+		trg.pool.Reset();
+		trg.polyline.clear();
+		for (const auto& p : border) trg.polyline.push_back(trg.pool.NewPoint(p.x, p.y));
+		trg.context.Reset(trg.polyline);
+		trg.points = trg.polyline;
+		for (const auto& h : holes) {
+			trg.hole.clear();
+			for (const auto& p : h) trg.hole.push_back(trg.pool.NewPoint(p.x, p.y));
+			trg.context.AddHole(trg.hole);
+			trg.points.insert(trg.points.end(), trg.hole.begin(), trg.hole.end());
+		}
+
+		trg.sweep.Triangulate(trg.context);
+		return trg.context.GetTriangles();
+	}
+
+	/**
+	 * Triangulates an arbitrary shape with poly2tri, with triangles sharing
+	 * their vertexes. Holes must be given in clockwise order.
+	 *
+	 * Triangles index the border's points followed by the holes' ones (in
+	 * order), which are also the returned positions.
+	 */
 	std::tuple<std::vector<ygl::vec3i>, std::vector<ygl::vec2f>>
-		triangulate(
+		triangulate_cdt_indexed(
+			triangulator& trg,
 			const std::vector<ygl::vec2f>& border,
 			const std::vector<std::vector<ygl::vec2f>>& holes = {}
 		) {
-		// Code adapted from https://github.com/greenm01/poly2tri/blob/master/testbed/main.cc
-		std::vector<p2t::Point*> polyline;
-		for (const auto& p : border) polyline.push_back(new p2t::Point(p.x, p.y));
+		auto p2t_triangles = __triangulate(trg, border, holes);
 
-		std::vector<std::vector<p2t::Point*>> p2t_holes;
-		for (const auto& hole : holes) {
-			p2t_holes.push_back(std::vector<p2t::Point*>());
-			for (const auto& p : hole) p2t_holes.back().push_back(new p2t::Point(p.x, p.y));
+		std::vector<ygl::vec2f> pos = border;
+		for (const auto& h : holes) pos.insert(pos.end(), h.begin(), h.end());
+		trg.point_ids.clear();
+		for (int i = 0; i < trg.points.size(); i++) trg.point_ids[trg.points[i]] = i;
+		std::vector<ygl::vec3i> triangles;
+		triangles.reserve(p2t_triangles.size());
+		for (auto t : p2t_triangles) {
+			ygl::vec3i tri;
+			for (int i = 0; i < 3; i++) {
+				auto it = trg.point_ids.find(t->GetPoint(i));
+				tri[i] = it != trg.point_ids.end() ? it->second : -1;
+			}
+			// Self-intersecting polygons can leak triangles touching the
+			// sweep's helper points, which aren't part of the polygon
+			if (tri.x < 0 || tri.y < 0 || tri.z < 0) continue;
+			triangles.push_back(tri);
+		}
+		return { triangles, pos };
+	}
+
+	enum class polygon_kind {
+		convex = 0,
+		monotone, // y-monotone
+		general
+	};
+
+	// Whether a comes before b when sweeping from top to bottom
+	bool __above(const ygl::vec2f& a, const ygl::vec2f& b) {
+		return a.y > b.y || (a.y == b.y && a.x < b.x);
+	}
+
+	// Top and bottom vertexes of a polygon, in sweep order
+	std::tuple<int, int> __top_bottom(const std::vector<ygl::vec2f>& poly) {
+		int top = 0, bottom = 0;
+		for (int i = 1; i < poly.size(); i++) {
+			if (__above(poly[i], poly[top])) top = i;
+			if (__above(poly[bottom], poly[i])) bottom = i;
+		}
+		return { top, bottom };
+	}
+
+	/**
+	 * Tells whether a polygon (with holes) is strictly convex, y-monotone
+	 * or neither, to choose how to triangulate it. Polygons with holes or
+	 * repeated consecutive points are always general.
+	 */
+	polygon_kind classify_polygon(
+		const std::vector<ygl::vec2f>& border,
+		const std::vector<std::vector<ygl::vec2f>>& holes = {}
+	) {
+		int n = border.size();
+		if (!holes.empty() || n < 3) return polygon_kind::general;
+
+		// Monotone: both chains go strictly down from the top to the bottom
+		int top, bottom;
+		std::tie(top, bottom) = __top_bottom(border);
+		for (int i = top; i != bottom; i = (i + 1) % n) {
+			if (!__above(border[i], border[(i + 1) % n])) return polygon_kind::general;
+		}
+		for (int i = top; i != bottom; i = (i + n - 1) % n) {
+			if (!__above(border[i], border[(i + n - 1) % n])) return polygon_kind::general;
+		}
+
+		// Convex: monotone and always turning the same way
+		float turn = 0.f;
+		for (int i = 0; i < n; i++) {
+			const auto& p1 = border[i];
+			const auto& p2 = border[(i + 1) % n];
+			const auto& p3 = border[(i + 2) % n];
+			auto c = ygl::cross(p2 - p1, p3 - p2);
+			if (c == 0.f || c*turn < 0.f) return polygon_kind::monotone;
+			turn = c;
+		}
+		return polygon_kind::convex;
+	}
+
+	/**
+	 * Triangulates a strictly convex polygon as a fan.
+	 * Triangles are counterclockwise and index the border.
+	 */
+	std::vector<ygl::vec3i> triangulate_convex(const std::vector<ygl::vec2f>& border) {
+		int n = border.size();
+		std::vector<ygl::vec3i> triangles;
+		triangles.reserve(n - 2);
+		auto ccw = ygl::cross(border[1] - border[0], border[2] - border[1]) > 0.f;
+		for (int i = 1; i < n - 1; i++) {
+			if (ccw) triangles.push_back({ 0, i, i + 1 });
+			else triangles.push_back({ 0, i + 1, i });
+		}
+		return triangles;
+	}
+
+	/**
+	 * Triangulates a y-monotone polygon in linear time.
+	 * Triangles are counterclockwise and index the border.
+	 *
+	 * See de Berg et al., Computational Geometry, chapter 3.
+	 */
+	std::vector<ygl::vec3i> triangulate_monotone(const std::vector<ygl::vec2f>& border) {
+		int n = border.size();
+		std::vector<ygl::vec3i> triangles;
+		triangles.reserve(n - 2);
+
+		float area = 0.f; // Twice the signed area
+		for (int i = 0; i < n; i++) area += ygl::cross(border[i], border[(i + 1) % n]);
+		auto ccw = area > 0.f;
+
+		// Merge the two chains in sweep order. Chain 0 follows the border's
+		// order from the top vertex, chain 1 goes the other way
+		int top, bottom;
+		std::tie(top, bottom) = __top_bottom(border);
+		std::vector<int> sorted = { top };
+		sorted.reserve(n);
+		std::vector<char> chain(n, 0);
+		int a = (top + 1) % n, b = (top + n - 1) % n;
+		while (a != bottom || b != bottom) {
+			if (a != bottom && (b == bottom || __above(border[a], border[b]))) {
+				sorted.push_back(a);
+				a = (a + 1) % n;
+			}
+			else {
+				chain[b] = 1;
+				sorted.push_back(b);
+				b = (b + n - 1) % n;
+			}
 		}
+		sorted.push_back(bottom);
+
+		auto add_triangle = [&](int i, int j, int k) {
+			if (ygl::cross(border[j] - border[i], border[k] - border[i]) > 0.f)
+				triangles.push_back({ i,j,k });
+			else
+				triangles.push_back({ i,k,j });
+		};
+		// Whether the diagonal u-t is inside the polygon, where l is between
+		// them on u's chain
+		auto inside = [&](int u, int l, int t) {
+			auto c = chain[u] == 0 ?
+				ygl::cross(border[l] - border[t], border[u] - border[l]) :
+				ygl::cross(border[l] - border[u], border[t] - border[l]);
+			return ccw ? c > 0.f : c < 0.f;
+		};
 
-		p2t::CDT* cdt = new p2t::CDT(polyline);
-		for (const auto& hole : p2t_holes) cdt->AddHole(hole);
+		std::vector<int> stack = { sorted[0], sorted[1] };
+		for (int j = 2; j < n - 1; j++) {
+			auto u = sorted[j];
+			if (chain[u] != chain[stack.back()]) {
+				// u sees all the vertexes on the stack
+				for (int k = 0; k < stack.size() - 1; k++) add_triangle(u, stack[k], stack[k + 1]);
+				stack = { sorted[j - 1], u };
+			}
+			else {
+				auto last = stack.back();
+				stack.pop_back();
+				while (!stack.empty() && inside(u, last, stack.back())) {
+					add_triangle(u, last, stack.back());
+					last = stack.back();
+					stack.pop_back();
+				}
+				stack.push_back(last);
+				stack.push_back(u);
+			}
+		}
+		// The bottom vertex sees all the ones left
+		for (int k = 0; k < stack.size() - 1; k++) add_triangle(sorted[n - 1], stack[k], stack[k + 1]);
+		return triangles;
+	}
 
-		cdt->Triangulate();
-		auto p2t_triangles = cdt->GetTriangles();
-		auto map = cdt->GetMap();
+	/**
+	 * Triangulates an arbitrary shape, with triangles sharing their vertexes.
+	 * Holes must be given in clockwise order.
+	 *
+	 * Triangles index the border's points followed by the holes' ones (in
+	 * order), which are also the returned positions.
+	 * Convex and y-monotone polygons without holes are triangulated directly,
+	 * only the others go through poly2tri.
+	 */
+	std::tuple<std::vector<ygl::vec3i>, std::vector<ygl::vec2f>>
+		triangulate_indexed(
+			triangulator& trg,
+			const std::vector<ygl::vec2f>& border,
+			const std::vector<std::vector<ygl::vec2f>>& holes = {}
+		) {
+		profile_scope prof(profile_stage::triangulate);
+		switch (classify_polygon(border, holes)) {
+		case polygon_kind::convex:
+			return { triangulate_convex(border), border };
+		case polygon_kind::monotone:
+			return { triangulate_monotone(border), border };
+		default:
+			return triangulate_cdt_indexed(trg, border, holes);
+		}
+	}
+
+	/**
+	* Triangulates an arbitrary shape.
+	* Holes must be given in clockwise order
+	*/
+	std::tuple<std::vector<ygl::vec3i>, std::vector<ygl::vec2f>>
+		triangulate(
+			triangulator& trg,
+			const std::vector<ygl::vec2f>& border,
+			const std::vector<std::vector<ygl::vec2f>>& holes = {}
+		) {
+		auto tt = triangulate_indexed(trg, border, holes);
+		const auto& indexed_pos = std::get<1>(tt);
 
+		// Three vertexes per triangle
 		std::vector<ygl::vec2f> pos;
 		std::vector<ygl::vec3i> triangles;
+		pos.reserve(std::get<0>(tt).size() * 3);
+		triangles.reserve(std::get<0>(tt).size());
 		int i = 0;
-		for (auto t : p2t_triangles) {
-			auto p1 = *t->GetPoint(0),
-				p2 = *t->GetPoint(1),
-				p3 = *t->GetPoint(2);
-			pos.push_back({ float(p1.x), float(p1.y) });
-			pos.push_back({ float(p2.x), float(p2.y) });
-			pos.push_back({ float(p3.x), float(p3.y) });
+		for (const auto& t : std::get<0>(tt)) {
+			pos.push_back(indexed_pos[t.x]);
+			pos.push_back(indexed_pos[t.y]);
+			pos.push_back(indexed_pos[t.z]);
 			triangles.push_back({ i,i + 1,i + 2 });
 			i += 3;
 		}
 
-		//Cleanup
-		for (auto p : polyline) delete p;
-		for (const auto& hole : p2t_holes) {
-			for (auto p : hole) {
-				delete p;
-			}
-		}
-
 		return { triangles, pos };
 	}
 
+	std::tuple<std::vector<ygl::vec3i>, std::vector<ygl::vec2f>>
+		triangulate(
+			const std::vector<ygl::vec2f>& border,
+			const std::vector<std::vector<ygl::vec2f>>& holes = {}
+		) {
+		return triangulate(get_thread_triangulator(), border, holes);
+	}
+
 	// NB: The points' y coordinate is discarded and then assumed to be 0
 	std::tuple<std::vector<ygl::vec3i>, std::vector<ygl::vec3f>>
 		triangulate(
@@ -344,6 +679,26 @@ namespace yb {
 		return { std::get<0>(tt), to_3d(std::get<1>(tt)) };
 	}
 
+	std::tuple<std::vector<ygl::vec3i>, std::vector<ygl::vec2f>>
+		triangulate_indexed(
+			const std::vector<ygl::vec2f>& border,
+			const std::vector<std::vector<ygl::vec2f>>& holes = {}
+		) {
+		return triangulate_indexed(get_thread_triangulator(), border, holes);
+	}
+
+	// NB: The points' y coordinate is discarded and then assumed to be 0
+	std::tuple<std::vector<ygl::vec3i>, std::vector<ygl::vec3f>>
+		triangulate_indexed(
+			const std::vector<ygl::vec3f>& border,
+			const std::vector<std::vector<ygl::vec3f>>& holes = {}
+		) {
+		std::vector<std::vector<ygl::vec2f>> _holes;
+		for (const auto& h : holes) _holes.push_back(to_2d(h));
+		auto tt = triangulate_indexed(to_2d(border), _holes);
+		return { std::get<0>(tt), to_3d(std::get<1>(tt)) };
+	}
+
 	/**
 	 * Triangulates the shape and inverts the triangles' orientation
 	 */
@@ -357,20 +712,88 @@ namespace yb {
 		return tt;
 	}
 
+	// Batch kernels on packed float components, 4 lanes at a time with SSE2
+
+	// Multiplies n floats by k
+	void __scale_floats(float* f, size_t n, float k) {
+		size_t i = 0;
+#if YB_SSE2
+		auto kk = _mm_set1_ps(k);
+		for (; i + 4 <= n; i += 4) _mm_storeu_ps(f + i, _mm_mul_ps(_mm_loadu_ps(f + i), kk));
+#endif
+		for (; i < n; i++) f[i] *= k;
+	}
+
+	// Adds d (of size dim, 2 or 3) to n points of packed components
+	void __displace_floats(float* f, size_t n, const float* d, int dim) {
+		size_t i = 0, nf = n*dim;
+#if YB_SSE2
+		if (dim == 2) {
+			auto dd = _mm_setr_ps(d[0], d[1], d[0], d[1]);
+			for (; i + 4 <= nf; i += 4) _mm_storeu_ps(f + i, _mm_add_ps(_mm_loadu_ps(f + i), dd));
+		}
+		else {
+			// 4 points span 3 registers, each with its own phase of d
+			auto d0 = _mm_setr_ps(d[0], d[1], d[2], d[0]);
+			auto d1 = _mm_setr_ps(d[1], d[2], d[0], d[1]);
+			auto d2 = _mm_setr_ps(d[2], d[0], d[1], d[2]);
+			for (; i + 12 <= nf; i += 12) {
+				_mm_storeu_ps(f + i, _mm_add_ps(_mm_loadu_ps(f + i), d0));
+				_mm_storeu_ps(f + i + 4, _mm_add_ps(_mm_loadu_ps(f + i + 4), d1));
+				_mm_storeu_ps(f + i + 8, _mm_add_ps(_mm_loadu_ps(f + i + 8), d2));
+			}
+		}
+#endif
+		for (; i < nf; i++) f[i] += d[i % dim];
+	}
+
+	// Rotates n 2D points of packed components by the angle of (c,s)
+	void __rotate_floats(float* f, size_t n, float c, float s) {
+		size_t i = 0, nf = 2 * n;
+#if YB_SSE2
+		// (x,y) -> (x,y)*c + (y,x)*(-s,s)
+		auto cc = _mm_set1_ps(c);
+		auto ss = _mm_setr_ps(-s, s, -s, s);
+		for (; i + 4 <= nf; i += 4) {
+			auto v = _mm_loadu_ps(f + i);
+			auto w = _mm_shuffle_ps(v, v, _MM_SHUFFLE(2, 3, 0, 1));
+			_mm_storeu_ps(f + i, _mm_add_ps(_mm_mul_ps(v, cc), _mm_mul_ps(w, ss)));
+		}
+#endif
+		for (; i < nf; i += 2) {
+			auto x = f[i], y = f[i + 1];
+			f[i] = x*c - y*s;
+			f[i + 1] = x*s + y*c;
+		}
+	}
+
 	/**
 	 * Moves all points by the specified value
 	 */
+	void displace(ygl::vec2f* points, size_t count, const ygl::vec2f& disp) {
+		__displace_floats(reinterpret_cast<float*>(points), count, &disp.x, 2);
+	}
+
+	void displace(ygl::vec3f* points, size_t count, const ygl::vec3f& disp) {
+		__displace_floats(reinterpret_cast<float*>(points), count, &disp.x, 3);
+	}
+
 	void displace(std::vector<ygl::vec2f>& points, const ygl::vec2f& disp) {
-		for (auto& p : points) p += disp;
+		displace(points.data(), points.size(), disp);
 	}
 
 	void displace(std::vector<ygl::vec3f>& points, const ygl::vec3f& disp) {
-		for (auto& p : points) p += disp;
+		displace(points.data(), points.size(), disp);
+	}
+
+	template<typename T>
+	void scale(T* points, size_t count, float scale) {
+		__scale_floats(reinterpret_cast<float*>(points), count*sizeof(T) / sizeof(float), scale);
 	}
 
 	template<typename T>
 	void scale(std::vector<T>& points, float scale) {
-		for (auto& p : points) p *= scale;
+		yb::scale(points.data(), points.size(), scale);
 	}
 
 	/**
@@ -409,13 +832,16 @@ namespace yb {
 	* Rotates the point by 'angle' radiants, counter-clockwise relative to (0,0)
 	*/
 	void rotate(ygl::vec2f& point, float angle) {
-		auto new_angle = atan2f(point.y, point.x) + angle;
-		auto length = ygl::length(point);
-		point = ygl::vec2f( cos(new_angle), sin(new_angle) )*length;
+		auto c = cosf(angle), s = sinf(angle);
+		point = { point.x*c - point.y*s, point.x*s + point.y*c };
+	}
+
+	void rotate(ygl::vec2f* points, size_t count, float angle) {
+		__rotate_floats(reinterpret_cast<float*>(points), count, cosf(angle), sinf(angle));
 	}
 
 	void rotate(std::vector<ygl::vec2f>& points, float angle) {
-		for (auto& p : points) rotate(p, angle);
+		rotate(points.data(), points.size(), angle);
 	}
 
 	/**
@@ -423,13 +849,24 @@ namespace yb {
 	 * counter-clockwise
 	 */
 	void rotate_y(ygl::vec3f& point, float angle) {
-		auto p2d = to_2d(point);
-		rotate(p2d, angle);
-		point = to_3d(p2d, point.y);
+		// Same as rotating to_2d(point), whose y is -z
+		auto c = cosf(angle), s = sinf(angle);
+		point = { point.x*c + point.z*s, point.y, point.z*c - point.x*s };
+	}
+
+	// Scalar: x and z are 2 floats apart in every point, with y between
+	// them, which makes shuffling them in packed registers cost more than
+	// it saves
+	void rotate_y(ygl::vec3f* points, size_t count, float angle) {
+		auto c = cosf(angle), s = sinf(angle);
+		for (size_t i = 0; i < count; i++) {
+			auto& p = points[i];
+			p = { p.x*c + p.z*s, p.y, p.z*c - p.x*s };
+		}
 	}
 
 	void rotate_y(std::vector<ygl::vec3f>& points, float angle) {
-		for (auto& p : points) rotate_y(p, angle);
+		rotate_y(points.data(), points.size(), angle);
 	}
 
 	/**
@@ -463,29 +900,102 @@ namespace yb {
 	}
 
 	/**
-	* Merges duplicates points in a shape
+	 * Keeps only the elements of a per-vertex array whose index is kept
+	 * (i.e. remap[i] == i for the i-th vertex). Arrays whose size does not
+	 * match the number of vertexes are left untouched.
+	 */
+	template<typename T>
+	void __compact_vertex_data(
+		std::vector<T>& data, const arena_vector<int>& kept, size_t num_vertexes
+	) {
+		if (data.size() != num_vertexes) return;
+		for (int i = 0; i < kept.size(); i++) data[i] = data[kept[i]];
+		data.resize(kept.size());
+	}
+
+	/**
+	 * Returns the grid cell coordinate of v for cells of size eps, clamped
+	 * to fit 64 bits (large coordinates overflow 32 bits even for
+	 * reasonable eps)
+	 */
+	int64_t __cell_coord(float v, float eps) {
+		auto c = std::floor(double(v) / eps);
+		return c > 4e18 ? int64_t(4e18) : c > -4e18 ? int64_t(c) : int64_t(-4e18);
+	}
+
+	/**
+	 * Returns the hash key of a grid cell. Distinct cells may share a key,
+	 * which only adds candidates to check.
+	 */
+	uint64_t __cell_key(int64_t x, int64_t y, int64_t z) {
+		return uint64_t(x) * 73856093ull ^ uint64_t(y) * 19349663ull ^ uint64_t(z) * 83492791ull;
+	}
+
+	/**
+	* Merges duplicates points in a shape.
 	*
-	* TODO: Remove duplicates from shp->pos
+	* Points closer than eps (and with colors closer than eps, if the shape
+	* has colors) are welded together: vertexes are hashed on a grid with
+	* cell size eps, so only the 27 cells around each point are searched.
+	* Duplicates are removed from the vertex data and all elements are
+	* remapped to the remaining vertexes.
 	*/
 	void merge_same_points(ygl::shape* shp, float eps = 0.0001f) {
-		for (int i = 0; i < shp->pos.size(); i++) {
-			for (int j = i + 1; j < shp->pos.size(); j++) {
-				if (
-					ygl::length(shp->pos[i] - shp->pos[j]) < eps &&
-					(shp->color.size() == 0 || ygl::length(shp->color[i]-shp->color[j]) < eps)
-				) {
-					for (auto& t : shp->triangles) {
-						for (auto& p : t) if (p == j) p = i;
-					}
-					for (auto& q : shp->quads) {
-						for (auto& p : q) if (p == j) p = i;
-					}
-					for (auto& l : shp->lines) {
-						for (auto& p : l) if (p == j) p = i;
+		auto num_vertexes = shp->pos.size();
+		bool has_color = shp->color.size() == num_vertexes;
+
+		// Temporary buffers are taken from the current arena, if any
+		scoped_arena_rewind rewind;
+		// Grid cell key -> new indexes of the vertexes kept in that cell
+		std::unordered_map<
+			uint64_t, arena_vector<int>,
+			std::hash<uint64_t>, std::equal_to<uint64_t>,
+			arena_allocator<std::pair<const uint64_t, arena_vector<int>>>
+		> grid;
+		grid.reserve(num_vertexes);
+		arena_vector<int> remap(num_vertexes); // Old index -> new index
+		arena_vector<int> kept; // New index -> old index
+		kept.reserve(num_vertexes);
+		for (int i = 0; i < num_vertexes; i++) {
+			const auto& p = shp->pos[i];
+			auto cx = __cell_coord(p.x, eps), cy = __cell_coord(p.y, eps), cz = __cell_coord(p.z, eps);
+			int found = -1;
+			for (int dx = -1; dx <= 1 && found < 0; dx++) {
+				for (int dy = -1; dy <= 1 && found < 0; dy++) {
+					for (int dz = -1; dz <= 1 && found < 0; dz++) {
+						auto it = grid.find(__cell_key(cx + dx, cy + dy, cz + dz));
+						if (it == grid.end()) continue;
+						for (auto k : it->second) {
+							auto j = kept[k];
+							if (ygl::length(p - shp->pos[j]) < eps &&
+								(!has_color || ygl::length(shp->color[i] - shp->color[j]) < eps)
+								) {
+								found = k;
+								break;
+							}
+						}
 					}
-					for (auto& p : shp->points) if (p == j) p = i;
 				}
 			}
+			if (found < 0) {
+				found = kept.size();
+				kept.push_back(i);
+				grid[__cell_key(cx, cy, cz)].push_back(found);
+			}
+			remap[i] = found;
+		}
+
+		if (kept.size() != num_vertexes) {
+			for (auto& t : shp->triangles) for (auto& p : t) p = remap[p];
+			for (auto& q : shp->quads) for (auto& p : q) p = remap[p];
+			for (auto& l : shp->lines) for (auto& p : l) p = remap[p];
+			for (auto& p : shp->points) p = remap[p];
+
+			__compact_vertex_data(shp->pos, kept, num_vertexes);
+			__compact_vertex_data(shp->norm, kept, num_vertexes);
+			__compact_vertex_data(shp->texcoord, kept, num_vertexes);
+			__compact_vertex_data(shp->color, kept, num_vertexes);
+			__compact_vertex_data(shp->radius, kept, num_vertexes);
 		}
 		shp->norm = ygl::compute_normals(shp->lines, shp->triangles, shp->quads, shp->pos);
 	}
@@ -498,6 +1008,7 @@ namespace yb {
 		ygl::shape* s2,
 		bool merge_points = true
 	) {
+		profile_scope prof(profile_stage::merge_shapes);
 		std::tie(s1->lines, s1->triangles, s1->quads) = ygl::merge_elems(
 			s1->pos.size(),
 			s1->lines, s1->triangles, s1->quads,
@@ -524,14 +1035,24 @@ namespace yb {
 		bool smooth_normals = true
 	) {
 		// Triangulate floor surface
-		auto triangles_data = triangulate(border, holes);
+		auto triangles_data = triangulate_indexed(border, holes);
 		const auto& triangles = std::get<0>(triangles_data);
 		const auto& triangles_pos = std::get<1>(triangles_data);
-		// Border vertexes are not reliable (e.g non-convex polygons)
-		auto face_norm = ygl::normalize(ygl::cross(triangles_pos[1]-triangles_pos[0], triangles_pos[2]-triangles_pos[0]));
+		// Border vertexes are not reliable (e.g non-convex polygons). The
+		// triangles are counterclockwise in 2d, so if poly2tri dropped all of
+		// them (e.g. for a self-intersecting polygon) the normal is that of
+		// any counterclockwise triangle.
+		auto t0_pos = triangles.empty() ?
+			to_3d(std::vector<ygl::vec2f>{ { 0,0 }, { 1,0 }, { 0,1 } }) :
+			std::vector<ygl::vec3f>{
+				triangles_pos[triangles[0].x],
+				triangles_pos[triangles[0].y],
+				triangles_pos[triangles[0].z]
+			};
+		auto face_norm = ygl::normalize(ygl::cross(t0_pos[1] - t0_pos[0], t0_pos[2] - t0_pos[0]));
 
 		// Outer walls
-		auto shape = new ygl::shape();
+		auto shape = make_new<ygl::shape>();
 		shape->pos = border;
 		for (const auto& p : border) {
 			shape->pos.push_back(p + face_norm*thickness);
@@ -587,24 +1108,11 @@ namespace yb {
 			}
 			ps += 2*hs; // Top and bottom of the hole
 		}
-		for (int i = ps; i < ps + triangles_pos.size(); i++) { // Floor and ceiling
-			// Naive all-points comparison to detect points on a border
-			if (smooth_normals) {
-				float eps = 0.001f;
-				for (int j = 0; j < ps; j++) {
-					if (ygl::length(shape->pos[i] - shape->pos[j]) <= eps) {
-						// I don't know why it's {shape->norm[i],...} and not {shape->norm[j],...},
-						// but it works :)
-						shape->norm[i] = ygl::normalize({ shape->norm[i].x, -1.f, shape->norm[i].z });
-						shape->norm[i + triangles_pos.size()] = ygl::normalize({ shape->norm[i].x, 1.f, shape->norm[i].z });
-						break;
-					}
-				}
-			}
-			else {
-				shape->norm[i] = { 0,-1,0 };
-				shape->norm[i + triangles_pos.size()] = { 0,1,0 };
-			}
+		// Floor and ceiling. All their vertexes lie on the border or on a hole,
+		// so they face straight down and up whether normals are smooth or not
+		for (int i = ps; i < ps + triangles_pos.size(); i++) {
+			shape->norm[i] = { 0,-1,0 };
+			shape->norm[i + triangles_pos.size()] = { 0,1,0 };
 		}
 		/*merge_same_points(shape);
 		set_shape_normals(shape);*/
@@ -1,18 +1,20 @@
 #ifndef GRAMMAR_H
 #define GRAMMAR_H
 
+#include <algorithm>
 #include <vector>
 #include <map>
-#include <queue>
+#include <stdexcept>
+#include <utility>
 
 #include "node.h"
+#include "prob_utils.h"
 
 namespace yb {
 
 	using std::string;
 	using std::vector;
 	using std::map;
-	using std::queue;
 	using std::pair;
 
 	template<typename T>
@@ -25,10 +27,248 @@ namespace yb {
 		float weight;
 	};
 
+	/**
+	 * A grammar compiled to flat tables, for fast derivations.
+	 *
+	 * Symbols are interned to dense ids, variables first, so that id is a
+	 * variable iff id < num_variables. The rules of variable v are
+	 * [rule_offsets[v], rule_offsets[v+1]), in insertion order, and the
+	 * right side of rule r is rhs[rhs_offsets[r]], ..., rhs[rhs_offsets[r+1]-1].
+	 *
+	 * Each variable's rules also hold its alias table (see make_alias_table),
+	 * with aliases relative to the variable's first rule.
+	 */
+	template<typename T>
+	struct compiled_grammar {
+		vector<T> symbols; // Id -> symbol
+		int start = 0;
+		int num_variables = 0;
+		vector<int> rule_offsets; // num_variables + 1 entries
+		vector<int> rhs_offsets; // num_rules + 1 entries
+		vector<int> rhs;
+		vector<float> weights; // Per rule
+		vector<float> alias_prob; // Per rule
+		vector<int> alias; // Per rule
+
+		int num_rules() const { return int(weights.size()); }
+
+		bool is_variable(int id) const { return id < num_variables; }
+	};
+
+	/**
+	 * Returns the rule expanding variable id, chosen by weight
+	 */
+	template<typename T>
+	int __choose_rule(const compiled_grammar<T>& g, int id, ygl::rng_pcg32& rng) {
+		auto first_rule = g.rule_offsets[id];
+		return first_rule + sample_alias(
+			rng, &g.alias_prob[first_rule], &g.alias[first_rule],
+			g.rule_offsets[id + 1] - first_rule
+		);
+	}
+
+	/**
+	 * Returns a random word from a compiled grammar (see grammar::produce).
+	 *
+	 * Nodes are expanded breadth-first, each variable choosing its rule
+	 * by weight in O(1) with the next draws from rng.
+	 */
+	template<typename T>
+	flat_tree<T> produce(const compiled_grammar<T>& g, ygl::rng_pcg32& rng) {
+		flat_tree<T> tree(g.symbols[g.start]);
+		// The nodes' array is the FIFO queue of the expansion: children are
+		// appended after all the nodes preceding them breadth-first
+		vector<int> ids = { g.start };
+		for (int i = 0; i < tree.size(); i++) {
+			if (!g.is_variable(ids[i])) continue;
+			auto rule = __choose_rule(g, ids[i], rng);
+			for (auto j = g.rhs_offsets[rule]; j < g.rhs_offsets[rule + 1]; j++) {
+				add_child(tree, i, g.symbols[g.rhs[j]]);
+				ids.push_back(g.rhs[j]);
+			}
+		}
+		return tree;
+	}
+
+	// Minimum number of subtrees a parallel derivation is split into, many
+	// more than the threads as subtrees' sizes can vary widely
+	const size_t __parallel_derivation_tasks = 1024;
+
+	/**
+	 * A tree node to expand, with its symbol and the key seeding its rng
+	 */
+	struct __keyed_node {
+		int i;
+		int id;
+		uint64_t key;
+	};
+
+	/**
+	 * Returns the key of the j-th child of the node with key k
+	 * (SplitMix64's finalizer on the pair)
+	 */
+	uint64_t __child_key(uint64_t k, int j) {
+		auto z = k + (uint64_t(j) + 1) * 0x9e3779b97f4a7c15ull;
+		z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ull;
+		z = (z ^ (z >> 27)) * 0x94d049bb133111ebull;
+		return z ^ (z >> 31);
+	}
+
+	/**
+	 * Adds the children of a node, if variable, with a rule chosen by the
+	 * node's own rng, and pushes them to out
+	 */
+	template<typename T>
+	void __expand_keyed(
+		const compiled_grammar<T>& g,
+		flat_tree<T>& tree,
+		const __keyed_node& kn,
+		vector<__keyed_node>& out
+	) {
+		if (!g.is_variable(kn.id)) return;
+		auto rng = ygl::init_rng(kn.key);
+		auto rule = __choose_rule(g, kn.id, rng);
+		auto rhs_begin = g.rhs_offsets[rule], rhs_end = g.rhs_offsets[rule + 1];
+		for (auto j = rhs_begin; j < rhs_end; j++) {
+			auto c = add_child(tree, kn.i, g.symbols[g.rhs[j]]);
+			out.push_back({ c, g.rhs[j], __child_key(kn.key, j - rhs_begin) });
+		}
+	}
+
+	/**
+	 * Returns a random word from a compiled grammar (see grammar::produce),
+	 * each node drawing from an rng keyed by seed and its path from the root.
+	 *
+	 * As the rule chosen for a node does not depend on the expansion order,
+	 * the top levels are expanded until there are enough subtrees, which are
+	 * then expanded in parallel if a pool is given and spliced into the
+	 * tree: the tree is the same with or without a pool.
+	 */
+	template<typename T>
+	flat_tree<T> produce(const compiled_grammar<T>& g, uint64_t seed, ygl::thread_pool* pool = nullptr) {
+		flat_tree<T> tree(g.symbols[g.start]);
+		vector<__keyed_node> level = { { 0, g.start, seed } }, next_level;
+		while (!level.empty() && level.size() < __parallel_derivation_tasks) {
+			for (const auto& kn : level) __expand_keyed(g, tree, kn, next_level);
+			std::swap(level, next_level);
+			next_level.clear();
+		}
+
+		// Subtrees are expanded depth-first, holding few pending nodes, into
+		// heap trees: the current arena must not be shared by the threads
+		vector<flat_tree<T>*> subtrees(level.size());
+		auto expand_subtree = [&](int s) {
+			scoped_arena no_arena(nullptr);
+			auto subtree = new flat_tree<T>(tree.value(level[s].i));
+			vector<__keyed_node> stack = { { 0, level[s].id, level[s].key } };
+			while (!stack.empty()) {
+				auto kn = stack.back();
+				stack.pop_back();
+				auto num_pending = stack.size();
+				__expand_keyed(g, *subtree, kn, stack);
+				std::reverse(stack.begin() + num_pending, stack.end());
+			}
+			subtrees[s] = subtree;
+		};
+
+		// Subtree s's nodes but its root go after those of the subtrees before
+		vector<int> offsets(subtrees.size() + 1, tree.size());
+		auto splice_subtree = [&](int s) {
+			auto remap = [&](int k) {
+				return k < 0 ? -1 : k == 0 ? level[s].i : offsets[s] + k - 1;
+			};
+			const auto& sub = subtrees[s]->nodes;
+			tree.nodes[level[s].i].first_child = remap(sub[0].first_child);
+			for (int k = 1; k < int(sub.size()); k++) {
+				tree.nodes[offsets[s] + k - 1] = {
+					sub[k].value, remap(sub[k].parent), remap(sub[k].first_child), remap(sub[k].next_sibling)
+				};
+			}
+			delete subtrees[s];
+		};
+
+		auto num_subtrees = int(subtrees.size());
+		if (pool) ygl::parallel_for(pool, num_subtrees, expand_subtree);
+		else for (int s = 0; s < num_subtrees; s++) expand_subtree(s);
+		for (int s = 0; s < num_subtrees; s++) offsets[s + 1] = offsets[s] + subtrees[s]->size() - 1;
+		tree.nodes.resize(offsets.back());
+		if (pool) ygl::parallel_for(pool, num_subtrees, splice_subtree);
+		else for (int s = 0; s < num_subtrees; s++) splice_subtree(s);
+		return tree;
+	}
+
+	/**
+	 * A symbol left to derive in a word stream, with the key seeding its rng
+	 */
+	struct __pending_symbol {
+		int id;
+		uint64_t key;
+	};
+
+	/**
+	 * Lazy leftmost derivation of a word, yielding its terminals one at a
+	 * time (see next_symbol) without building the derivation tree.
+	 *
+	 * Only the symbols still to derive on the path from the root to the
+	 * current leaf are held, at most max_pending. The grammar must outlive
+	 * the stream and not be recompiled meanwhile.
+	 */
+	template<typename T>
+	struct word_stream {
+		const compiled_grammar<T>* g = nullptr;
+		vector<__pending_symbol> stack;
+		size_t max_pending = 0;
+	};
+
+	/**
+	 * Starts streaming the word derived from seed: the terminals are those
+	 * of produce(g, seed), in the same order
+	 */
+	template<typename T>
+	word_stream<T> make_word_stream(
+		const compiled_grammar<T>& g,
+		uint64_t seed,
+		size_t max_pending = 1 << 20
+	) {
+		word_stream<T> ws;
+		ws.g = &g;
+		ws.stack.push_back({ g.start, seed });
+		ws.max_pending = max_pending;
+		return ws;
+	}
+
+	/**
+	 * Returns the next terminal of the word, or nullptr at its end.
+	 * Throws if the derivation needs more than max_pending symbols.
+	 */
+	template<typename T>
+	const T* next_symbol(word_stream<T>& ws) {
+		const auto& g = *ws.g;
+		while (!ws.stack.empty()) {
+			auto ps = ws.stack.back();
+			ws.stack.pop_back();
+			if (!g.is_variable(ps.id)) return &g.symbols[ps.id];
+
+			auto rng = ygl::init_rng(ps.key);
+			auto rule = __choose_rule(g, ps.id, rng);
+			auto rhs_begin = g.rhs_offsets[rule], rhs_end = g.rhs_offsets[rule + 1];
+			if (ws.stack.size() + (rhs_end - rhs_begin) > ws.max_pending) {
+				throw std::runtime_error("Too many pending symbols in the word stream");
+			}
+			// Rightmost first, so that the leftmost is derived next
+			for (auto j = rhs_end - 1; j >= rhs_begin; j--) {
+				ws.stack.push_back({ g.rhs[j], __child_key(ps.key, j - rhs_begin) });
+			}
+		}
+		return nullptr;
+	}
+
 	template<typename T>
 	class grammar {
 		T S;
 		map<T, vector<production_rule<T>>> prods;
+		compiled_grammar<T> compiled;
+		bool compiled_valid = false;
 
 	public:
 		grammar(const T& S) : S(S) {}
@@ -38,6 +278,7 @@ namespace yb {
 		 */
 		void add_rule(const production_rule<T>& rule) {
 			prods[rule.from].push_back(rule);
+			compiled_valid = false;
 		}
 
 		void add_rule(const T& from, const vector<T>& to, float weight = 1.f) {
@@ -65,44 +306,90 @@ namespace yb {
 
 		// Whether the symbol is terminal, i.e. it is not the left side
 		// of any production rule
-		bool is_terminal(const T& value) {
+		bool is_terminal(const T& value) const {
 			return prods.count(value) == 0;
 		}
 
 		// Whether the symbol is variable for the grammar, i.e. it is
 		// the left side of a production rule
-		bool is_variable(const T& value) {
+		bool is_variable(const T& value) const {
 			return !is_terminal(value);
 		}
 
+		/**
+		 * Interns the symbols and flattens the rules into tables.
+		 * The result is cached until a rule is added.
+		 * Throws if a variable's rules have negative weights or weights
+		 * summing to 0.
+		 */
+		const compiled_grammar<T>& compile() {
+			if (compiled_valid) return compiled;
+			auto& g = compiled;
+			g = compiled_grammar<T>();
+			map<T, int> ids;
+			auto intern = [&](const T& value) {
+				auto it = ids.find(value);
+				if (it != ids.end()) return it->second;
+				ids[value] = int(g.symbols.size());
+				g.symbols.push_back(value);
+				return int(g.symbols.size()) - 1;
+			};
+			for (const auto& p : prods) intern(p.first);
+			g.num_variables = int(g.symbols.size());
+			g.start = intern(S);
+			g.rule_offsets.push_back(0);
+			g.rhs_offsets.push_back(0);
+			for (const auto& p : prods) {
+				for (const auto& rule : p.second) {
+					for (const auto& value : rule.to) g.rhs.push_back(intern(value));
+					g.rhs_offsets.push_back(int(g.rhs.size()));
+					g.weights.push_back(rule.weight);
+				}
+				g.rule_offsets.push_back(g.num_rules());
+			}
+			g.alias_prob.resize(g.num_rules());
+			g.alias.resize(g.num_rules());
+			for (int v = 0; v < g.num_variables; v++) {
+				auto first_rule = g.rule_offsets[v];
+				make_alias_table(
+					&g.weights[first_rule], g.rule_offsets[v + 1] - first_rule,
+					&g.alias_prob[first_rule], &g.alias[first_rule]
+				);
+			}
+			compiled_valid = true;
+			return g;
+		}
+
 		/**
 		 * Returns a random word from the grammar by using
 		 * leftmost derivation.
 		 * The word symbols are the leaves of the returned tree, in the
 		 * order determined by a DFS, minus variables V involved in a
 		 * V -> <empty> production.
-		 *
-		 * TODO: multithreaded expansion
+		 * Rules are chosen according to their weights, drawing from rng:
+		 * the same rng state gives the same word.
 		 */
-		node<T>* produce() {
-			node<T>* root = new node<T>(S);
-			queue<node<T>*> nodes;
-			nodes.push(root);
-			while (!nodes.empty()) {
-				node<T>* n = nodes.front();
-				nodes.pop();
-
-				if (is_variable(n->value)) {
-					auto& prod = prods.find(n->value);
-					auto& prod_rules = (*prod).second;
-					auto& substitution = prod_rules[rand() % prod_rules.size()];
-					for (auto& child_value : substitution.to) {
-						n->add_child(child_value);
-						nodes.push(n->children.back());
-					}
-				}
-			}
-			return root;
+		flat_tree<T> produce(ygl::rng_pcg32& rng) {
+			return yb::produce(compile(), rng);
+		}
+
+		/**
+		 * Returns a random word from the grammar as above, with each node
+		 * drawing from its own rng keyed by seed and its path from the root.
+		 * If a pool is given subtrees are expanded in parallel, giving the
+		 * same tree as without.
+		 */
+		flat_tree<T> produce(uint64_t seed, ygl::thread_pool* pool = nullptr) {
+			return yb::produce(compile(), seed, pool);
+		}
+
+		/**
+		 * Streams the terminals of the word produce(seed) would return, one
+		 * at a time through next_symbol, holding O(depth) symbols instead
+		 * of the tree. No rule must be added while streaming.
+		 */
+		word_stream<T> make_word_stream(uint64_t seed, size_t max_pending = 1 << 20) {
+			return yb::make_word_stream(compile(), seed, max_pending);
 		}
 	};
 }
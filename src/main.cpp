@@ -1,7 +1,11 @@
 #include <cstdio>
+#include <cstdlib>
 #include <iostream>
+#include <new>
 #include <string>
 #include <ctime>
+#include <thread>
+#include <unordered_set>
 
 #include "yocto/yocto_gl.h"
 
@@ -10,26 +14,48 @@
 #include "prob_utils.h"
 #include "yocto_utils.h"
 #include "building_utils.h"
+#include "city_utils.h"
+#include "profiler.h"
 
 int main(int argc, char** argv) {
 	auto parser =
 		ygl::make_parser(argc, argv, "ybuildings", "make procedural buildings and cities");
-	std::string filename =
-		ygl::parse_arg(parser, "scene", "scene filename", std::string());
 	int buildings_per_side =
 		ygl::parse_opt(parser, "--num-buildings", "-n", "number of buildings on a side of the city square", 14);
 	bool make_sky =
 		!ygl::parse_flag(parser, "--no-sky", "", "avoid making a skybox", false, false);
+	bool instanced_floors =
+		ygl::parse_flag(parser, "--instanced-floors", "", "share floor shapes among floors of non-widening buildings", false, false);
+	bool dedup =
+		ygl::parse_flag(parser, "--dedup-shapes", "", "share geometrically identical shapes among instances", false, false);
+	bool window_arrays =
+		ygl::parse_flag(parser, "--window-arrays", "", "keep windows as per-facade instance arrays until saving", false, false);
+	float mat_quantization =
+		ygl::parse_opt(parser, "--material-quantization", "", "step to round building colors to, to share more materials (0 for exact colors)", 0.f);
+	int seed =
+		ygl::parse_opt(parser, "--seed", "-s", "city seed (random if negative)", -1);
+	int num_threads =
+		ygl::parse_opt(parser, "--threads", "-t", "number of generation threads (0 for all cores)", 1);
+	float lod_distance =
+		ygl::parse_opt(parser, "--lod-distance", "", "camera distance beyond which buildings get coarser, one level each time it doubles (0 for full detail)", 0.f);
+	int tile_size =
+		ygl::parse_opt(parser, "--tile-size", "", "buildings on a side of a tile, each tile is saved to its own file (0 for a single file)", 0);
+	std::string profile_filename =
+		ygl::parse_opt(parser, "--profile", "", "file to save the generation stages' timings and heap bytes to, as JSON (bytes are counted in every run, at a thread-local add per allocation)", std::string());
+	std::string filename =
+		ygl::parse_arg(parser, "scene", "scene filename", std::string());
 	if (should_exit(parser)) {
 		printf("%s\n", get_usage(parser).c_str());
 		exit(1);
 	}
 
 	srand(time(NULL));
+	if (seed < 0) seed = rand();
+	if (num_threads <= 0) num_threads = std::thread::hardware_concurrency();
+	yb::profiler prof;
+	if (!profile_filename.empty()) yb::set_profiler(&prof);
 	ygl::scene* scn = new ygl::scene();
 
-	ygl::rng_pcg32 rng = ygl::init_rng(rand());
-
 	//Add floor
 	auto floor_mat = yb::make_material("floor_mat", { 0.3f,0.3f,0.1f }, nullptr, { 0,0,0 });
 	auto floor_shape = new ygl::shape();
@@ -54,35 +80,95 @@ int main(int argc, char** argv) {
 	std::tie(open_window_shape, closed_window_shape) =
 		yb::make_test_windows("wnd_op", "wnd_cls");
 
-	auto space_between = 70.f;
-	auto start_pos = space_between*(buildings_per_side - 1) / 2.f;
-	for (int i = 0; i < buildings_per_side*buildings_per_side; i++) {
-		yb::building_params *params = yb::make_rand_building_params(
-			rng, open_window_shape, closed_window_shape, "building" + std::to_string(i)
-		);
-
-		auto insts = yb::make_building(*params);
-		for (auto inst : insts) {
-			ygl::facet_shape(inst->shp);
-			inst->shp->norm = ygl::compute_normals(
-				inst->shp->lines, inst->shp->triangles, inst->shp->quads, inst->shp->pos
+	// Window shapes are shared by all buildings, so they're processed here
+	// rather than concurrently by each building
+	for (auto shp : { open_window_shape, closed_window_shape }) {
+		ygl::facet_shape(shp);
+		shp->norm = ygl::compute_normals(shp->lines, shp->triangles, shp->quads, shp->pos);
+	}
+	auto window_width = yb::get_window_width(open_window_shape, closed_window_shape);
+
+	yb::city_params city_pars;
+	city_pars.buildings_per_side = buildings_per_side;
+	city_pars.seed = seed;
+	city_pars.instanced_floors = instanced_floors;
+	city_pars.open_window_shape = open_window_shape;
+	city_pars.closed_window_shape = closed_window_shape;
+	city_pars.window_width = window_width;
+	auto num_buildings = buildings_per_side*buildings_per_side;
+	auto cam_pos = ygl::vec3f{ 0.f,220.f,800.f };
+
+	auto pool = num_threads > 1 ? ygl::make_pool(num_threads) : nullptr;
+
+	// Makes the buildings with the given indexes and adds them to the scene.
+	// Generated objects are allocated from the arenas, which must be
+	// released together with the scene; windows kept as instance arrays
+	// are appended to windows.
+	auto add_buildings = [&](
+		ygl::scene* scn,
+		const std::vector<int>& ids,
+		yb::arena_pool& arenas,
+		yb::material_cache& mat_cache,
+		std::vector<yb::instance_array>& windows
+	) {
+		// Each building draws from its own PCG stream (selected by its index),
+		// so the city only depends on the seed and not on the thread count
+		std::vector<std::vector<ygl::instance*>> buildings_insts(ids.size());
+		std::vector<std::vector<yb::instance_array>> buildings_windows(ids.size());
+		auto make_city_building = [&](int k) {
+			auto i = ids[k];
+			yb::scoped_arena arena_scope(yb::thread_arena(arenas));
+			ygl::rng_pcg32 rng;
+			yb::building_params *params = yb::make_city_building_params(city_pars, i, rng);
+			params->lod = yb::select_building_lod(
+				ygl::length(yb::get_building_position(city_pars, i) - cam_pos), lod_distance
 			);
+			params->mat_cache = &mat_cache;
+			if (window_arrays) params->window_arrays = &buildings_windows[k];
+			buildings_insts[k] = yb::make_city_building(city_pars, i, *params);
+
+			yb::make_delete(params);
+		};
+		if (pool) {
+			ygl::parallel_for(pool, int(ids.size()), make_city_building);
+		}
+		else {
+			for (int k = 0; k < ids.size(); k++) make_city_building(k);
 		}
 
-		// Displacement
-		for (auto inst : insts) {
-			yb::translate(
-				inst,
-				{
-					-start_pos + space_between * (i / buildings_per_side) + space_between / 2.f*(i % 2),
-					0,
-					-start_pos + space_between * (i % buildings_per_side)
-				}
-			);
+		// Merge in building order, independently of which thread made them
+		auto builder = yb::make_scene_builder(scn);
+		size_t num_insts = 0;
+		for (const auto& insts : buildings_insts) num_insts += insts.size();
+		yb::reserve(builder, num_insts, num_insts, num_insts);
+		for (const auto& insts : buildings_insts) yb::add_to_scene(builder, insts);
+		yb::commit(builder);
+		yb::name_cached_materials(scn, &mat_cache, "building_mat");
+
+		if (dedup) {
+			// Duplicates are owned by the arenas, no need to delete them
+			std::vector<ygl::shape*> duplicates;
+			auto stats = yb::dedup_shapes(scn, 0.0001f, &duplicates);
+			printf("Removed %d duplicate shapes out of %d (%.2f MB saved)\n",
+				stats.num_removed, stats.num_shapes, stats.bytes_saved / (1024.f * 1024.f));
+		}
+
+		for (auto& arrays : buildings_windows) {
+			windows.insert(windows.end(), arrays.begin(), arrays.end());
 		}
-		for (auto inst : insts) yb::add_to_scene(scn, inst);
-		
-		delete params;
+	};
+
+	// Generated objects are allocated from per-thread arenas, released
+	// all together once the scene is saved
+	yb::arena_pool arenas;
+	// Buildings with the same colors share materials
+	yb::material_cache mat_cache;
+	mat_cache.quantization = mat_quantization;
+	std::vector<yb::instance_array> windows;
+	if (tile_size <= 0) {
+		std::vector<int> ids(num_buildings);
+		for (int i = 0; i < num_buildings; i++) ids[i] = i;
+		add_buildings(scn, ids, arenas, mat_cache, windows);
 	}
 
 	// Sky
@@ -131,7 +217,7 @@ int main(int argc, char** argv) {
 	// add camera
 	auto cam = new ygl::camera{ "cam" };
 	cam->frame = ygl::lookat_frame3f(
-		{ 0.f,220.f,800.f }, { 0.f, 20.f, 0.f }, { 0.f, 1.f, 0.f }
+		cam_pos, { 0.f, 20.f, 0.f }, { 0.f, 1.f, 0.f }
 	);
 	cam->yfov = 15.f * yb::pi / 180.f;
 	cam->aspect = 16.0f / 9.0f;
@@ -140,7 +226,73 @@ int main(int argc, char** argv) {
 	cam->ortho = false;
 	scn->cameras.push_back(cam);
 
-	ygl::save_scene(filename, scn, ygl::save_options());
+	yb::save_scene(filename, scn, windows, ygl::save_options());
+	yb::release(arenas, scn);
+
+	if (tile_size > 0) {
+		// The scene above only holds the environment. The buildings are made
+		// one tile at a time, each saved to its own file and released before
+		// the next, so memory depends on the tile size and not on the city's
+		auto manifest_filename = ygl::replace_path_extension(filename, ".tiles.json");
+		auto manifest = fopen(manifest_filename.c_str(), "w");
+		if (!manifest) throw std::runtime_error("cannot open " + manifest_filename);
+		auto num_tiles = (buildings_per_side + tile_size - 1) / tile_size;
+		fprintf(manifest, "{\n");
+		fprintf(manifest, "  \"scene\": \"%s\",\n", ygl::path_filename(filename).c_str());
+		fprintf(manifest, "  \"buildings_per_side\": %d,\n", buildings_per_side);
+		fprintf(manifest, "  \"tile_size\": %d,\n", tile_size);
+		fprintf(manifest, "  \"tiles\": [\n");
+		for (int tx = 0; tx < num_tiles; tx++) {
+			for (int tz = 0; tz < num_tiles; tz++) {
+				// Buildings are laid out by index as (i / side, i % side) on (x,z)
+				std::vector<int> ids;
+				for (int x = tx*tile_size; x < std::min((tx + 1)*tile_size, buildings_per_side); x++) {
+					for (int z = tz*tile_size; z < std::min((tz + 1)*tile_size, buildings_per_side); z++) {
+						ids.push_back(x*buildings_per_side + z);
+					}
+				}
+
+				auto tile_scn = new ygl::scene();
+				yb::arena_pool tile_arenas;
+				yb::material_cache tile_mat_cache;
+				tile_mat_cache.quantization = mat_quantization;
+				std::vector<yb::instance_array> tile_windows;
+				add_buildings(tile_scn, ids, tile_arenas, tile_mat_cache, tile_windows);
+
+				auto tile_filename = ygl::prepend_path_extension(
+					filename, "_tile_" + std::to_string(tx) + "_" + std::to_string(tz)
+				);
+				auto bbox = yb::get_bbox(tile_scn, tile_windows);
+				yb::save_scene(tile_filename, tile_scn, tile_windows, ygl::save_options());
+				fprintf(manifest,
+					"    { \"file\": \"%s\", \"tile\": [%d, %d], \"num_buildings\": %d, "
+					"\"bbox\": { \"min\": [%g, %g, %g], \"max\": [%g, %g, %g] } }%s\n",
+					ygl::path_filename(tile_filename).c_str(), tx, tz, int(ids.size()),
+					bbox.min.x, bbox.min.y, bbox.min.z, bbox.max.x, bbox.max.y, bbox.max.z,
+					tx == num_tiles - 1 && tz == num_tiles - 1 ? "" : ","
+				);
+
+				// The window shapes are shared by all tiles
+				yb::remove_from_scene(tile_scn, { open_window_shape, closed_window_shape });
+				yb::release(tile_arenas, tile_scn);
+				delete tile_scn;
+			}
+		}
+		fprintf(manifest, "  ]\n}\n");
+		fclose(manifest);
+
+		// Not in any scene, so not deleted with them
+		for (auto shp : { open_window_shape, closed_window_shape }) {
+			yb::make_delete(shp->mat);
+			yb::make_delete(shp);
+		}
+	}
+	if (pool) delete pool;
+
+	if (!profile_filename.empty()) {
+		yb::set_profiler(nullptr);
+		yb::save_profile(profile_filename, &prof);
+	}
 
 	return 0;
 }
\ No newline at end of file
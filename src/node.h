@@ -1,9 +1,13 @@
 #ifndef NODE_H
 #define NODE_H
 
+#include <algorithm>
 #include <functional>
+#include <iostream>
 #include <vector>
 
+#include "arena.h"
+
 namespace yb {
 
 	/**
@@ -36,8 +40,8 @@ namespace yb {
 
 	template<typename T>
 	void preorder_visit(const node<T>& n, const std::function<void(const T&)>& action) {
-		action(value);
-		for (auto c : children) {
+		action(n.value);
+		for (auto c : n.children) {
 			preorder_visit(*c, action);
 		}
 	}
@@ -79,6 +83,193 @@ namespace yb {
 		}
 		return d;
 	}
+
+	// A node of a flat_tree, with its links as indices in the array
+	template<typename T>
+	struct flat_node {
+		T value;
+		int parent;
+		int first_child;
+		int next_sibling;
+	};
+
+	/**
+	 * A tree stored in a single array of nodes, linked by indices (-1 for
+	 * none). The root is node 0 and nodes can only be added.
+	 *
+	 * The array is taken from the arena current at construction, if any
+	 * (see arena_allocator), and trees of any depth are visited and
+	 * destroyed without recursion.
+	 */
+	template<typename T>
+	struct flat_tree {
+		arena_vector<flat_node<T>> nodes;
+
+		flat_tree() {}
+		flat_tree(const T& root_value) {
+			nodes.push_back({ root_value, -1, -1, -1 });
+		}
+
+		int size() const { return int(nodes.size()); }
+		bool empty() const { return nodes.empty(); }
+
+		const T& value(int i) const { return nodes[i].value; }
+		bool is_leaf(int i) const { return nodes[i].first_child < 0; }
+	};
+
+	/**
+	 * Adds a child as the last one of parent, returning its index.
+	 * O(1) when the parent's children are added consecutively, otherwise
+	 * linear in the parent's children.
+	 */
+	template<typename T>
+	int add_child(flat_tree<T>& tree, int parent, const T& value) {
+		auto i = tree.size();
+		tree.nodes.push_back({ value, parent, -1, -1 });
+		auto& p = tree.nodes[parent];
+		if (p.first_child < 0) {
+			p.first_child = i;
+			return i;
+		}
+		auto last = i - 1;
+		if (tree.nodes[last].parent != parent || tree.nodes[last].next_sibling >= 0) {
+			last = p.first_child;
+			while (tree.nodes[last].next_sibling >= 0) last = tree.nodes[last].next_sibling;
+		}
+		tree.nodes[last].next_sibling = i;
+		return i;
+	}
+
+	template<typename T>
+	int __next_preorder(const flat_tree<T>& tree, int i) {
+		if (tree.nodes[i].first_child >= 0) return tree.nodes[i].first_child;
+		while (i >= 0 && tree.nodes[i].next_sibling < 0) i = tree.nodes[i].parent;
+		return i < 0 ? -1 : tree.nodes[i].next_sibling;
+	}
+
+	template<typename T>
+	int __first_leaf(const flat_tree<T>& tree, int i) {
+		while (i >= 0 && tree.nodes[i].first_child >= 0) i = tree.nodes[i].first_child;
+		return i;
+	}
+
+	template<typename T>
+	int __next_postorder(const flat_tree<T>& tree, int i) {
+		if (tree.nodes[i].next_sibling >= 0) return __first_leaf(tree, tree.nodes[i].next_sibling);
+		return tree.nodes[i].parent;
+	}
+
+	template<typename T>
+	int __next_leaf(const flat_tree<T>& tree, int i) {
+		if (tree.nodes[i].first_child >= 0) return __first_leaf(tree, i);
+		while (i >= 0 && tree.nodes[i].next_sibling < 0) i = tree.nodes[i].parent;
+		return i < 0 ? -1 : __first_leaf(tree, tree.nodes[i].next_sibling);
+	}
+
+	/**
+	 * Forward iterator over the indices of a flat tree's nodes, in the order
+	 * given by next
+	 */
+	template<typename T, int(*next)(const flat_tree<T>&, int)>
+	struct flat_tree_iterator {
+		const flat_tree<T>* tree;
+		int i;
+
+		int operator*() const { return i; }
+		flat_tree_iterator& operator++() { i = next(*tree, i); return *this; }
+		bool operator==(const flat_tree_iterator& other) const { return i == other.i; }
+		bool operator!=(const flat_tree_iterator& other) const { return i != other.i; }
+	};
+
+	template<typename T, int(*next)(const flat_tree<T>&, int)>
+	struct flat_tree_range {
+		flat_tree_iterator<T, next> first;
+
+		flat_tree_iterator<T, next> begin() const { return first; }
+		flat_tree_iterator<T, next> end() const { return { first.tree, -1 }; }
+	};
+
+	/**
+	 * Ranges over the indices of the nodes in preorder, in postorder, and of
+	 * the leaves from left to right, e.g.
+	 *     for (auto i : leaves(tree)) word.push_back(tree.value(i));
+	 */
+	template<typename T>
+	flat_tree_range<T, __next_preorder<T>> preorder(const flat_tree<T>& tree) {
+		return { { &tree, tree.empty() ? -1 : 0 } };
+	}
+
+	template<typename T>
+	flat_tree_range<T, __next_postorder<T>> postorder(const flat_tree<T>& tree) {
+		return { { &tree, tree.empty() ? -1 : __first_leaf(tree, 0) } };
+	}
+
+	template<typename T>
+	flat_tree_range<T, __next_leaf<T>> leaves(const flat_tree<T>& tree) {
+		return { { &tree, tree.empty() ? -1 : __first_leaf(tree, 0) } };
+	}
+
+	/**
+	 * Calls visit on each node (a flat_node<T>) in preorder, in postorder,
+	 * or on each leaf
+	 */
+	template<typename T, typename Visitor>
+	void preorder_visit(const flat_tree<T>& tree, Visitor&& visit) {
+		for (auto i : preorder(tree)) visit(tree.nodes[i]);
+	}
+
+	template<typename T, typename Visitor>
+	void postorder_visit(const flat_tree<T>& tree, Visitor&& visit) {
+		for (auto i : postorder(tree)) visit(tree.nodes[i]);
+	}
+
+	template<typename T, typename Visitor>
+	void leaves_visit(const flat_tree<T>& tree, Visitor&& visit) {
+		for (auto i : leaves(tree)) visit(tree.nodes[i]);
+	}
+
+	/**
+	 * Calls visit(i, level) on each node in preorder, level being the
+	 * node's distance from the root
+	 */
+	template<typename T, typename Visitor>
+	void __preorder_visit_levels(const flat_tree<T>& tree, Visitor&& visit) {
+		if (tree.empty()) return;
+		int i = 0, level = 0;
+		while (i >= 0) {
+			visit(i, level);
+			const auto& n = tree.nodes[i];
+			if (n.first_child >= 0) {
+				i = n.first_child;
+				level++;
+				continue;
+			}
+			while (i >= 0 && tree.nodes[i].next_sibling < 0) {
+				i = tree.nodes[i].parent;
+				level--;
+			}
+			if (i >= 0) i = tree.nodes[i].next_sibling;
+		}
+	}
+
+	template<typename T>
+	void print_tree(const flat_tree<T>& tree) {
+		__preorder_visit_levels(tree, [&tree](int i, int level) {
+			for (int l = 0; l < level - 1; l++) std::cout << "|   ";
+			if (level > 0) std::cout << "|---";
+			std::cout << tree.value(i) << "\n";
+		});
+	}
+
+	/**
+	 * Returns the depth of a flat tree (0 for a single node)
+	 */
+	template<typename T>
+	int depth(const flat_tree<T>& tree) {
+		int d = 0;
+		__preorder_visit_levels(tree, [&d](int, int level) { d = std::max(d, level); });
+		return d;
+	}
 }
 
 #endif // NODE_H
\ No newline at end of file
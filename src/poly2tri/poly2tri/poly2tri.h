@@ -34,6 +34,7 @@
 
 #include "common/shapes.h"
 #include "sweep/cdt.h"
+#include "sweep/sweep_pool.h"
 
 #endif
 
@@ -31,10 +31,12 @@
 #include "sweep_context.h"
 #include <algorithm>
 #include "advancing_front.h"
+#include "sweep_pool.h"
 
 namespace p2t {
 
 SweepContext::SweepContext(std::vector<Point*> polyline) :
+  pool_(0),
   front_(0),
   head_(0),
   tail_(0),
@@ -50,6 +52,48 @@ SweepContext::SweepContext(std::vector<Point*> polyline) :
   InitEdges(points_);
 }
 
+SweepContext::SweepContext(SweepPool& pool) :
+  pool_(&pool),
+  front_(0),
+  head_(0),
+  tail_(0),
+  af_head_(0),
+  af_middle_(0),
+  af_tail_(0)
+{
+}
+
+void SweepContext::Reset(std::vector<Point*> polyline)
+{
+  basin.Clear();
+  edge_event = EdgeEvent();
+  edge_list.clear();
+  triangles_.clear();
+  map_.clear();
+  front_ = 0;
+  head_ = tail_ = 0;
+  af_head_ = af_middle_ = af_tail_ = 0;
+
+  points_ = polyline;
+
+  InitEdges(points_);
+}
+
+Triangle* SweepContext::NewTriangle(Point& a, Point& b, Point& c)
+{
+  return pool_ ? pool_->NewTriangle(a, b, c) : new Triangle(a, b, c);
+}
+
+Node* SweepContext::NewNode(Point& p)
+{
+  return pool_ ? pool_->NewNode(p) : new Node(p);
+}
+
+Node* SweepContext::NewNode(Point& p, Triangle& t)
+{
+  return pool_ ? pool_->NewNode(p, t) : new Node(p, t);
+}
+
 void SweepContext::AddHole(std::vector<Point*> polyline)
 {
   InitEdges(polyline);
@@ -92,8 +136,8 @@ void SweepContext::InitTriangulation()
 
   double dx = kAlpha * (xmax - xmin);
   double dy = kAlpha * (ymax - ymin);
-  head_ = new Point(xmax + dx, ymin - dy);
-  tail_ = new Point(xmin - dx, ymin - dy);
+  head_ = pool_ ? pool_->NewPoint(xmax + dx, ymin - dy) : new Point(xmax + dx, ymin - dy);
+  tail_ = pool_ ? pool_->NewPoint(xmin - dx, ymin - dy) : new Point(xmin - dx, ymin - dy);
 
   // Sort points along y-axis
   std::sort(points_.begin(), points_.end(), cmp);
@@ -105,7 +149,9 @@ void SweepContext::InitEdges(std::vector<Point*> polyline)
   int num_points = polyline.size();
   for (int i = 0; i < num_points; i++) {
     int j = i < num_points - 1 ? i + 1 : 0;
-    edge_list.push_back(new Edge(*polyline[i], *polyline[j]));
+    edge_list.push_back(
+      pool_ ? pool_->NewEdge(*polyline[i], *polyline[j]) : new Edge(*polyline[i], *polyline[j])
+    );
   }
 }
 
@@ -130,14 +176,16 @@ void SweepContext::CreateAdvancingFront(std::vector<Node*> nodes)
 
   (void) nodes;
   // Initial triangle
-  Triangle* triangle = new Triangle(*points_[0], *tail_, *head_);
+  Triangle* triangle = NewTriangle(*points_[0], *tail_, *head_);
 
   map_.push_back(triangle);
 
-  af_head_ = new Node(*triangle->GetPoint(1), *triangle);
-  af_middle_ = new Node(*triangle->GetPoint(0), *triangle);
-  af_tail_ = new Node(*triangle->GetPoint(2));
-  front_ = new AdvancingFront(*af_head_, *af_tail_);
+  af_head_ = NewNode(*triangle->GetPoint(1), *triangle);
+  af_middle_ = NewNode(*triangle->GetPoint(0), *triangle);
+  af_tail_ = NewNode(*triangle->GetPoint(2));
+  front_ = pool_ ?
+    pool_->NewAdvancingFront(*af_head_, *af_tail_) :
+    new AdvancingFront(*af_head_, *af_tail_);
 
   // TODO: More intuitive if head is middles next and not previous?
   //       so swap head and tail
@@ -149,7 +197,7 @@ void SweepContext::CreateAdvancingFront(std::vector<Node*> nodes)
 
 void SweepContext::RemoveNode(Node* node)
 {
-  delete node;
+  if (!pool_) delete node;
 }
 
 void SweepContext::MapTriangleToNodes(Triangle& t)
@@ -192,6 +240,7 @@ SweepContext::~SweepContext()
 {
 
     // Clean up memory
+    if (pool_) return; // Owned by the pool
 
     delete head_;
     delete tail_;
@@ -47,12 +47,16 @@ class Triangle;
 struct Node;
 struct Edge;
 class AdvancingFront;
+class SweepPool;
 
 class SweepContext {
 public:
 
 /// Constructor
 SweepContext(std::vector<Point*> polyline);
+/// Constructor for a reusable context, whose objects are made from the pool
+/// (which must outlive it). Set the polyline with Reset
+SweepContext(SweepPool& pool);
 /// Destructor
 ~SweepContext();
 
@@ -85,6 +89,10 @@ void RemoveFromMap(Triangle* triangle);
 
 void AddHole(std::vector<Point*> polyline);
 
+/// Clear a pooled context for a new triangulation, and set its polyline.
+/// The pool must be reset separately
+void Reset(std::vector<Point*> polyline);
+
 void AddPoint(Point* point);
 
 AdvancingFront* front();
@@ -133,6 +141,13 @@ private:
 
 friend class Sweep;
 
+// If set, objects are made from the pool and never deleted
+SweepPool* pool_;
+
+Triangle* NewTriangle(Point& a, Point& b, Point& c);
+Node* NewNode(Point& p);
+Node* NewNode(Point& p, Triangle& t);
+
 std::vector<Triangle*> triangles_;
 std::list<Triangle*> map_;
 std::vector<Point*> points_;
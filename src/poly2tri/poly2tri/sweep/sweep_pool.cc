@@ -0,0 +1,82 @@
+/* 
+ * Poly2Tri Copyright (c) 2009-2010, Poly2Tri Contributors
+ * http://code.google.com/p/poly2tri/
+ *
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without modification,
+ * are permitted provided that the following conditions are met:
+ *
+ * * Redistributions of source code must retain the above copyright notice,
+ *   this list of conditions and the following disclaimer.
+ * * Redistributions in binary form must reproduce the above copyright notice,
+ *   this list of conditions and the following disclaimer in the documentation
+ *   and/or other materials provided with the distribution.
+ * * Neither the name of Poly2Tri nor the names of its contributors may be
+ *   used to endorse or promote products derived from this software without specific
+ *   prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ * A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR
+ * CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL,
+ * EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+ * PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR
+ * PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF
+ * LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING
+ * NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+#include "sweep_pool.h"
+
+namespace p2t {
+
+Point* SweepPool::NewPoint(double x, double y)
+{
+  if (points_.used == points_.items.size()) {
+    points_.items.emplace_back(x, y);
+    return &points_.items[points_.used++];
+  }
+  // Reuse the point's edge list too
+  Point* point = &points_.items[points_.used++];
+  point->set(x, y);
+  point->edge_list.clear();
+  return point;
+}
+
+Edge* SweepPool::NewEdge(Point& p1, Point& p2)
+{
+  return edges_.Make(p1, p2);
+}
+
+Triangle* SweepPool::NewTriangle(Point& a, Point& b, Point& c)
+{
+  return triangles_.Make(a, b, c);
+}
+
+Node* SweepPool::NewNode(Point& p)
+{
+  return nodes_.Make(p);
+}
+
+Node* SweepPool::NewNode(Point& p, Triangle& t)
+{
+  return nodes_.Make(p, t);
+}
+
+AdvancingFront* SweepPool::NewAdvancingFront(Node& head, Node& tail)
+{
+  return fronts_.Make(head, tail);
+}
+
+void SweepPool::Reset()
+{
+  points_.used = 0;
+  edges_.used = 0;
+  triangles_.used = 0;
+  nodes_.used = 0;
+  fronts_.used = 0;
+}
+
+}
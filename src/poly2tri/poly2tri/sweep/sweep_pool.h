@@ -0,0 +1,95 @@
+/* 
+ * Poly2Tri Copyright (c) 2009-2010, Poly2Tri Contributors
+ * http://code.google.com/p/poly2tri/
+ *
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without modification,
+ * are permitted provided that the following conditions are met:
+ *
+ * * Redistributions of source code must retain the above copyright notice,
+ *   this list of conditions and the following disclaimer.
+ * * Redistributions in binary form must reproduce the above copyright notice,
+ *   this list of conditions and the following disclaimer in the documentation
+ *   and/or other materials provided with the distribution.
+ * * Neither the name of Poly2Tri nor the names of its contributors may be
+ *   used to endorse or promote products derived from this software without specific
+ *   prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ * A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR
+ * CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL,
+ * EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+ * PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR
+ * PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF
+ * LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING
+ * NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifndef SWEEP_POOL_H
+#define SWEEP_POOL_H
+
+#include <deque>
+#include <new>
+#include "../common/shapes.h"
+#include "advancing_front.h"
+
+namespace p2t {
+
+/**
+ * Storage for the points, edges, triangles and advancing front nodes made
+ * during a triangulation.
+ *
+ * Objects are never freed one by one: Reset makes all of them available to
+ * the next triangulation, keeping the memory, which is only released with
+ * the pool. Not thread safe.
+ */
+class SweepPool {
+public:
+
+  Point* NewPoint(double x, double y);
+  Edge* NewEdge(Point& p1, Point& p2);
+  Triangle* NewTriangle(Point& a, Point& b, Point& c);
+  Node* NewNode(Point& p);
+  Node* NewNode(Point& p, Triangle& t);
+  AdvancingFront* NewAdvancingFront(Node& head, Node& tail);
+
+  /// Recycle all the objects made so far
+  void Reset();
+
+private:
+
+  // Objects are kept in deques so their addresses are stable
+  template <class T>
+  struct Storage {
+    std::deque<T> items;
+    size_t used = 0;
+
+    template <class... Args>
+    T* Make(Args&... args)
+    {
+      if (used == items.size()) {
+        items.emplace_back(args...);
+      } else {
+        T* obj = &items[used];
+        obj->~T();
+        new (obj) T(args...);
+      }
+      return &items[used++];
+    }
+  };
+
+  Storage<Point> points_;
+  Storage<Edge> edges_;
+  Storage<Triangle> triangles_;
+  Storage<Node> nodes_;
+  Storage<AdvancingFront> fronts_;
+
+};
+
+}
+
+#endif
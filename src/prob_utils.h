@@ -3,6 +3,8 @@
 
 #include <limits>
 #include <ctime>
+#include <stdexcept>
+#include <vector>
 
 #include "yocto\yocto_gl.h"
 
@@ -101,7 +103,7 @@ namespace yb {
 		float u1 = ygl::next_rand1f(rng);
 		float u2 = ygl::next_rand1f(rng);
 		
-		float x1 = sqrt(-2.f*log(u1))*cos(2.f*pi*u2);
+		float x1 = sqrt(-2.f*log(u1))*cos(2.f*ygl::pi*u2);
 		return x1 * sigma + mu;
 	}
 
@@ -121,6 +123,74 @@ namespace yb {
 		return which;
 	}
 
+	/**
+	 * Walker's alias table, to sample a discrete distribution in O(1).
+	 * Entry i is kept with probability prob[i], otherwise alias[i] is
+	 * returned.
+	 */
+	struct alias_table {
+		std::vector<float> prob;
+		std::vector<int> alias;
+	};
+
+	/**
+	 * Fills the alias table of n weights into prob and alias (n entries each),
+	 * with Vose's method. The weights must be non-negative, with a positive sum.
+	 */
+	void make_alias_table(const float* weights, int n, float* prob, int* alias) {
+		double weights_total = 0.0;
+		for (int i = 0; i < n; i++) {
+			if (weights[i] < 0.f) throw std::runtime_error("Negative weight");
+			weights_total += weights[i];
+		}
+		if (!(weights_total > 0.0)) throw std::runtime_error("Weights must have a positive sum");
+
+		// Probabilities scaled so that the average is 1, split into the
+		// entries below and above it
+		std::vector<double> scaled(n);
+		std::vector<int> small, large;
+		for (int i = 0; i < n; i++) {
+			scaled[i] = weights[i] * n / weights_total;
+			(scaled[i] < 1.0 ? small : large).push_back(i);
+		}
+		while (!small.empty() && !large.empty()) {
+			auto s = small.back(), l = large.back();
+			small.pop_back();
+			prob[s] = float(scaled[s]);
+			alias[s] = l;
+			scaled[l] -= 1.0 - scaled[s];
+			if (scaled[l] < 1.0) {
+				large.pop_back();
+				small.push_back(l);
+			}
+		}
+		// What is left is 1 up to rounding errors
+		for (auto i : small) { prob[i] = 1.f; alias[i] = i; }
+		for (auto i : large) { prob[i] = 1.f; alias[i] = i; }
+	}
+
+	alias_table make_alias_table(const std::vector<float>& weights) {
+		alias_table table;
+		table.prob.resize(weights.size());
+		table.alias.resize(weights.size());
+		make_alias_table(weights.data(), int(weights.size()), table.prob.data(), table.alias.data());
+		return table;
+	}
+
+	/**
+	 * Returns a random int in [0, n) from the alias table in prob and alias,
+	 * drawing nothing from rng if n is 1
+	 */
+	int sample_alias(ygl::rng_pcg32& rng, const float* prob, const int* alias, int n) {
+		if (n == 1) return 0;
+		int i = ygl::next_rand1i(rng, n);
+		return ygl::next_rand1f(rng) < prob[i] ? i : alias[i];
+	}
+
+	int sample_alias(ygl::rng_pcg32& rng, const alias_table& table) {
+		return sample_alias(rng, table.prob.data(), table.alias.data(), int(table.prob.size()));
+	}
+
 	/**
 	 * Choose a random element from a vector
 	 */
@@ -0,0 +1,176 @@
+#ifndef PROFILER_H
+#define PROFILER_H
+
+#include <algorithm>
+#include <cstdio>
+#include <mutex>
+#include <stdexcept>
+#include <string>
+#include <thread>
+#include <unordered_map>
+#include <vector>
+
+#include "yocto\yocto_gl.h"
+
+/**
+ * Per-stage profiling of the generation pipeline.
+ *
+ * Stages are timed by a profile_scope placed at their start. Nothing is
+ * recorded unless a profiler is set with set_profiler, so that a scope
+ * costs a single check when profiling is off. Each thread records into
+ * its own buffer, merged when the profile is saved.
+ *
+ * Stages can nest (e.g. floors triangulate and offset polygons), their
+ * times and bytes are inclusive.
+ */
+
+namespace yb {
+
+	enum class profile_stage {
+		building_params = 0,
+		floors,
+		roof,
+		windows,
+		triangulate,
+		offset_polygon,
+		merge_shapes,
+		normals,
+		save_scene,
+		count
+	};
+
+	const char* __profile_stage_names[] = {
+		"make_rand_building_params",
+		"make_floors_from_params",
+		"make_roof_from_params",
+		"make_windows",
+		"triangulate",
+		"offset_polygon",
+		"merge_shapes",
+		"facet_shape/compute_normals",
+		"save_scene"
+	};
+
+	// Heap bytes requested by the calling thread, counted by the global
+	// operator new of profiler_alloc.cpp, which programs including this
+	// header must link
+	extern thread_local size_t __thread_allocated_bytes;
+
+	struct profile_buffer {
+		std::vector<float> times[int(profile_stage::count)]; // In seconds
+		size_t bytes[int(profile_stage::count)] = {};
+	};
+
+	struct profiler {
+		std::mutex mtx;
+		std::unordered_map<std::thread::id, profile_buffer*> buffers;
+		ygl::timer wall_timer;
+		int id = 0; // Unique, to tell profilers apart in the threads' caches
+
+		profiler() {
+			static int num_profilers = 0;
+			id = ++num_profilers;
+		}
+		profiler(const profiler&) = delete;
+		profiler& operator=(const profiler&) = delete;
+		~profiler() {
+			for (auto& b : buffers) delete b.second;
+		}
+	};
+
+	// Profiler recording the stages, if any
+	profiler* __profiler = nullptr;
+
+	/**
+	 * Sets the profiler recording the stages of all threads (nullptr to stop
+	 * profiling). Must not be called while stages are running.
+	 */
+	void set_profiler(profiler* prof) {
+		__profiler = prof;
+	}
+
+	/**
+	 * Returns the calling thread's buffer in the profiler
+	 */
+	profile_buffer* __get_profile_buffer(profiler* prof) {
+		thread_local int cached_id = 0;
+		thread_local profile_buffer* cached = nullptr;
+		if (cached_id != prof->id) {
+			std::lock_guard<std::mutex> lock(prof->mtx);
+			auto& b = prof->buffers[std::this_thread::get_id()];
+			if (!b) b = new profile_buffer();
+			cached = b;
+			cached_id = prof->id;
+		}
+		return cached;
+	}
+
+	/**
+	 * Records the time and heap bytes of a stage from its construction to
+	 * its destruction
+	 */
+	struct profile_scope {
+		profile_buffer* buf = nullptr;
+		int stage = 0;
+		size_t start_bytes = 0;
+		ygl::timer tmr = ygl::timer(false);
+
+		profile_scope(profile_stage s) {
+			if (!__profiler) return;
+			buf = __get_profile_buffer(__profiler);
+			stage = int(s);
+			start_bytes = __thread_allocated_bytes;
+			tmr.start();
+		}
+		profile_scope(const profile_scope&) = delete;
+		profile_scope& operator=(const profile_scope&) = delete;
+		~profile_scope() {
+			if (!buf) return;
+			buf->times[stage].push_back(float(tmr.elapsed()));
+			buf->bytes[stage] += __thread_allocated_bytes - start_bytes;
+		}
+	};
+
+	/**
+	 * Saves the calls, total and percentile times and allocated bytes of
+	 * each stage as JSON
+	 */
+	void save_profile(const std::string& filename, profiler* prof) {
+		auto f = fopen(filename.c_str(), "w");
+		if (!f) throw std::runtime_error("cannot open " + filename);
+		std::lock_guard<std::mutex> lock(prof->mtx);
+		fprintf(f, "{\n");
+		fprintf(f, "  \"wall_ms\": %.3f,\n", prof->wall_timer.elapsed()*1000.0);
+		fprintf(f, "  \"threads\": %d,\n", int(prof->buffers.size()));
+		fprintf(f, "  \"stages\": {\n");
+		for (int s = 0; s < int(profile_stage::count); s++) {
+			std::vector<float> times;
+			size_t bytes = 0;
+			for (const auto& b : prof->buffers) {
+				times.insert(times.end(), b.second->times[s].begin(), b.second->times[s].end());
+				bytes += b.second->bytes[s];
+			}
+			std::sort(times.begin(), times.end());
+			double total = 0.0;
+			for (auto t : times) total += t;
+			auto percentile_us = [&times](float p) {
+				if (times.empty()) return 0.0;
+				return times[std::min(times.size() - 1, size_t(p*times.size()))]*1e6;
+			};
+			fprintf(f,
+				"    \"%s\": { \"calls\": %zu, \"total_ms\": %.3f, \"mean_us\": %.3f, "
+				"\"p50_us\": %.3f, \"p90_us\": %.3f, \"p99_us\": %.3f, \"max_us\": %.3f, "
+				"\"bytes\": %zu }%s\n",
+				__profile_stage_names[s], times.size(), total*1000.0,
+				times.empty() ? 0.0 : total / times.size()*1e6,
+				percentile_us(0.5f), percentile_us(0.9f), percentile_us(0.99f),
+				times.empty() ? 0.0 : times.back()*1e6, bytes,
+				s == int(profile_stage::count) - 1 ? "" : ","
+			);
+		}
+		fprintf(f, "  }\n}\n");
+		fclose(f);
+	}
+}
+
+#endif // PROFILER_H
@@ -0,0 +1,40 @@
+#include <cstddef>
+#include <cstdlib>
+#include <new>
+
+// Replaces the global allocation functions to count the heap bytes requested
+// by each thread, for the profiler (see profile_scope in profiler.h).
+// Every program including profiler.h links this file, so the count is kept
+// in every run, profiling or not: a thread-local add per allocation.
+
+namespace yb {
+	thread_local size_t __thread_allocated_bytes = 0;
+}
+
+void* operator new(size_t size) {
+	yb::__thread_allocated_bytes += size;
+	if (auto p = malloc(size ? size : 1)) return p;
+	throw std::bad_alloc();
+}
+
+void* operator new[](size_t size) {
+	return operator new(size);
+}
+
+void operator delete(void* p) noexcept {
+	free(p);
+}
+
+// The other forms go through the one above, pairing with operator new
+
+void operator delete[](void* p) noexcept {
+	operator delete(p);
+}
+
+void operator delete(void* p, size_t) noexcept {
+	operator delete(p);
+}
+
+void operator delete[](void* p, size_t) noexcept {
+	operator delete(p);
+}
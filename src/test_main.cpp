@@ -1,6 +1,707 @@
+#include <algorithm>
+#include <cmath>
 #include <cstdio>
+#include <fstream>
+#include <sstream>
+#include <stdexcept>
+#include <string>
+#include <unordered_set>
+#include <vector>
+
+#include "yocto/yocto_gl.h"
+
+#include "arena.h"
+#include "geom_utils.h"
+#include "grammar.h"
+#include "building_utils.h"
+#include "city_utils.h"
+#include "yocto_utils.h"
+
+// Quick checks of the generation utilities, run by ctest
+
+void check(bool cond, const std::string& what) {
+	if (!cond) throw std::runtime_error(what);
+}
+
+std::string read_file(const std::string& filename) {
+	std::ifstream f(filename);
+	std::stringstream ss;
+	ss << f.rdbuf();
+	return ss.str();
+}
+
+void test_merge_same_points() {
+	auto shp = new ygl::shape();
+	// A quad's corners, each repeated within eps, plus two coincident
+	// points with different colors, far from the origin so that their
+	// grid cells overflow 32 bits
+	shp->pos = {
+		{ 0,0,0 }, { 1,0,0 }, { 1,1,0 }, { 0,1,0 },
+		{ 0.00001f,0,0 }, { 1,0.00001f,0 }, { 1,1,0.00001f }, { 0,1,0 },
+		{ 1e6f,1e6f,0 }, { 1e6f,1e6f,0 }
+	};
+	shp->color = {
+		{ 1,1,1,1 }, { 1,1,1,1 }, { 1,1,1,1 }, { 1,1,1,1 },
+		{ 1,1,1,1 }, { 1,1,1,1 }, { 1,1,1,1 }, { 1,1,1,1 },
+		{ 1,0,0,1 }, { 0,1,0,1 }
+	};
+	shp->triangles = { { 0,1,2 }, { 4,6,7 }, { 5,8,9 } };
+	auto old_pos = shp->pos;
+	auto old_color = shp->color;
+	auto old_triangles = shp->triangles;
+
+	yb::merge_same_points(shp);
+
+	check(shp->pos.size() == 6, "duplicates are removed");
+	check(shp->color.size() == 6 && shp->norm.size() == 6, "vertex data is compacted");
+	for (int t = 0; t < shp->triangles.size(); t++) {
+		for (int k = 0; k < 3; k++) {
+			auto i = old_triangles[t][k], j = shp->triangles[t][k];
+			check(j >= 0 && j < shp->pos.size(), "indexes are in range");
+			check(ygl::length(old_pos[i] - shp->pos[j]) < 0.0001f, "indexes are remapped to welded points");
+			check(old_color[i] == shp->color[j], "colors follow their points");
+		}
+	}
+	check(shp->triangles[2].y != shp->triangles[2].z, "points with different colors are not welded");
+	delete shp;
+}
+
+void test_make_delete() {
+	yb::arena a, b;
+	ygl::shape* shp;
+	{
+		yb::scoped_arena arena_scope(&a);
+		shp = yb::make_new<ygl::shape>();
+		shp->pos.resize(1000);
+	}
+	check(yb::__find_owner_arena(shp) == &a, "objects know their arena");
+	// Objects of a non-current arena are left to it
+	{
+		yb::scoped_arena arena_scope(&b);
+		yb::make_delete(shp);
+	}
+	yb::make_delete(shp);
+	check(shp->pos.size() == 1000, "objects are released with their arena");
+	yb::release(&a);
+	check(!yb::__find_owner_arena(shp), "released blocks are forgotten");
+
+	// Heap objects are deleted, whatever the current arena
+	auto heap_shp = yb::make_new<ygl::shape>();
+	check(!yb::__find_owner_arena(heap_shp), "heap objects have no arena");
+	yb::scoped_arena arena_scope(&b);
+	yb::make_delete(heap_shp);
+}
+
+void test_make_floors_from_regular() {
+	auto throws = [](unsigned num_floors, float floor_height) {
+		try {
+			yb::make_floors_from_regular({ 0,0 }, 6, 5.f, 0.f, num_floors, floor_height, 0.5f, 0.2f);
+		}
+		catch (const std::runtime_error&) {
+			return true;
+		}
+		return false;
+	};
+	check(throws(0, 3.f), "no floors are rejected");
+	check(throws(2, 0.f), "flat floors are rejected");
+
+	ygl::shape *floors, *belts;
+	std::tie(floors, belts) = yb::make_floors_from_regular({ 0,0 }, 6, 5.f, 0.f, 3, 3.f, 0.5f, 0.2f);
+	auto bbox = ygl::make_bbox(floors->pos.size(), floors->pos.data());
+	check(fabsf(bbox.max.y - (3 * 3.f + 2 * 0.5f)) < 0.001f, "floors and belts are stacked");
+	check(!belts->pos.empty(), "belts are made");
+	check(floors->norm.size() == floors->pos.size() && belts->norm.size() == belts->pos.size(),
+		"stacked floors and belts keep their normals");
+	for (auto n : floors->norm) check(fabsf(ygl::length(n) - 1.f) < 0.001f, "normals are unit length");
+	delete floors;
+	delete belts;
+
+	// Per-vertex data sized to pos is carried to the stack
+	auto level = yb::thicken_polygon(std::vector<ygl::vec2f>{ { 0,0 }, { 1,0 }, { 1,1 }, { 0,1 } }, 1.f);
+	level->color.assign(level->pos.size(), { 1,0,0,1 });
+	level->texcoord.assign(level->pos.size(), { 0.5f,0.5f });
+	auto stack = yb::__stack_shapes({ level }, 3, 2.f);
+	check(stack->color.size() == stack->pos.size() && stack->texcoord.size() == stack->pos.size(),
+		"stacked shapes keep their colors and texcoords");
+	for (auto c : stack->color) check(c == ygl::vec4f{ 1,0,0,1 }, "colors are carried");
+	delete level;
+	delete stack;
+}
+
+// Makes a city's buildings with the given number of threads, sharing a
+// material cache as main does, and returns the materials' names by instance
+std::vector<std::string> make_city_material_names(yb::city_params city_pars, int num_threads) {
+	auto num_buildings = city_pars.buildings_per_side*city_pars.buildings_per_side;
+	auto scn = new ygl::scene();
+	yb::arena_pool arenas;
+	yb::material_cache mat_cache;
+	std::vector<std::vector<ygl::instance*>> buildings_insts(num_buildings);
+	auto make_city_building = [&](int i) {
+		yb::scoped_arena arena_scope(yb::thread_arena(arenas));
+		ygl::rng_pcg32 rng;
+		auto params = yb::make_city_building_params(city_pars, i, rng);
+		params->mat_cache = &mat_cache;
+		buildings_insts[i] = yb::make_city_building(city_pars, i, *params);
+	};
+	auto pool = ygl::make_pool(num_threads);
+	ygl::parallel_for(pool, num_buildings, make_city_building);
+	delete pool;
+
+	std::unordered_set<ygl::material*> cached;
+	for (const auto& kv : mat_cache.materials) cached.insert(kv.second);
+	for (const auto& insts : buildings_insts) {
+		for (auto inst : insts) {
+			auto mat = inst->shp->mat;
+			if (!cached.count(mat)) continue;
+			check(mat->name.compare(0, 11, "cached_mat_") == 0, "cached materials are only named by the cache");
+		}
+	}
+
+	auto builder = yb::make_scene_builder(scn);
+	for (const auto& insts : buildings_insts) yb::add_to_scene(builder, insts);
+	yb::commit(builder);
+	yb::name_cached_materials(scn, &mat_cache, "building_mat");
+	std::vector<std::string> names;
+	for (auto inst : scn->instances) names.push_back(inst->shp->mat ? inst->shp->mat->name : "");
+	yb::remove_from_scene(scn, { city_pars.open_window_shape, city_pars.closed_window_shape });
+	yb::release(arenas, scn);
+	delete scn;
+	return names;
+}
+
+void test_parallel_city_materials() {
+	ygl::shape *open_window_shape, *closed_window_shape;
+	std::tie(open_window_shape, closed_window_shape) = yb::make_test_windows("wnd_op", "wnd_cls");
+	yb::city_params city_pars;
+	city_pars.buildings_per_side = 8;
+	city_pars.seed = 8;
+	city_pars.open_window_shape = open_window_shape;
+	city_pars.closed_window_shape = closed_window_shape;
+	city_pars.window_width = yb::get_window_width(open_window_shape, closed_window_shape);
+
+	auto names = make_city_material_names(city_pars, 1);
+	for (auto num_threads : { 4, 8 }) {
+		check(make_city_material_names(city_pars, num_threads) == names,
+			"materials are named the same with any number of threads");
+	}
+	delete open_window_shape;
+	delete closed_window_shape;
+}
+
+void test_save_scene_with_arrays() {
+	auto make_window = [](const std::string& name) {
+		auto shp = new ygl::shape();
+		shp->name = name + "_shape";
+		shp->pos = { { 0,0,0 }, { 1,0,0 }, { 0,1,0 } };
+		shp->triangles = { { 0,1,2 } };
+		shp->mat = new ygl::material();
+		shp->mat->name = name + "_mat";
+		return shp;
+	};
+	yb::instance_array arr;
+	arr.name = "wnd";
+	arr.frame.o = { 1,2,3 };
+	arr.step = { 2,0,0 };
+	arr.count = 4;
+	arr.shp_on = make_window("wnd_op");
+	arr.shp_off = make_window("wnd_cls");
+	arr.present = { true, true, false, true };
+	arr.on = { true, false, true, true };
+
+	// The arrays' shapes and materials are only in the scene while saving
+	auto scn = new ygl::scene();
+	yb::save_scene("test_arrays_a.obj", scn, { arr });
+	check(scn->shapes.empty() && scn->materials.empty() && scn->instances.empty(),
+		"the scene is restored after saving");
+
+	for (auto shp : { arr.shp_on, arr.shp_off }) {
+		scn->shapes.push_back(shp);
+		scn->materials.push_back(shp->mat);
+	}
+	scn->instances = yb::expand_instance_array(arr);
+	ygl::save_scene("test_arrays_b.obj", scn, ygl::save_options());
+
+	auto obj_a = read_file("test_arrays_a.obj"), obj_b = read_file("test_arrays_b.obj");
+	auto mtllib = obj_a.find("test_arrays_a.mtl");
+	if (mtllib != std::string::npos) obj_a.replace(mtllib, 17, "test_arrays_b.mtl");
+	check(obj_a.find("wnd_op_shape") != std::string::npos, "the arrays' shapes are saved");
+	check(obj_a == obj_b, "arrays are saved as their expanded instances");
+	check(read_file("test_arrays_a.mtl") == read_file("test_arrays_b.mtl"), "the arrays' materials are saved");
+	for (auto f : { "test_arrays_a.obj", "test_arrays_a.mtl", "test_arrays_b.obj", "test_arrays_b.mtl" }) {
+		remove(f);
+	}
+	delete scn;
+}
+
+void test_instance_array_bvh() {
+	auto rng = ygl::init_rng(9);
+	ygl::shape *wnd_on, *wnd_off;
+	std::tie(wnd_on, wnd_off) = yb::make_test_windows("wnd_op", "wnd_cls");
+
+	// A box in the scene and rows of windows on its sides, some rotated,
+	// spaced so that they do not overlap
+	auto scn = new ygl::scene();
+	auto box = new ygl::shape();
+	std::tie(box->quads, box->pos) = yb::make_parallelepidedon(10, 10, 10, 0, 0, 0, true);
+	scn->shapes.push_back(box);
+	scn->instances.push_back(yb::make_instance("box", box));
+	std::vector<yb::instance_array> arrays;
+	for (int a = 0; a < 12; a++) {
+		yb::instance_array arr;
+		arr.name = "wnd_" + std::to_string(a);
+		arr.frame = ygl::rotation_frame3f({ 0,1,0 }, ygl::pi / 2 * (a % 4));
+		arr.frame.o = ygl::transform_point(arr.frame, ygl::vec3f{ -4.f, -4.f + a / 4 * 3.f, 5.2f });
+		arr.step = ygl::transform_vector(arr.frame, ygl::vec3f{ 2.f, 0, 0 });
+		arr.count = 5;
+		arr.shp_on = wnd_on;
+		arr.shp_off = wnd_off;
+		for (int k = 0; k < arr.count; k++) {
+			arr.present.push_back(ygl::next_rand1f(rng) < 0.8f);
+			arr.on.push_back(ygl::next_rand1f(rng) < 0.5f);
+		}
+		arrays.push_back(arr);
+	}
+	auto sb = yb::make_scene_bvh(scn, arrays);
+
+	// The same scene with the arrays expanded to one instance per window
+	auto expanded = new ygl::scene();
+	expanded->shapes = { box, wnd_on, wnd_off };
+	expanded->instances = scn->instances;
+	std::vector<std::pair<int, int>> slots = { { -1, -1 } }; // Instance -> array and slot
+	for (int a = 0; a < arrays.size(); a++) {
+		for (auto inst : yb::expand_instance_array(arrays[a])) expanded->instances.push_back(inst);
+		for (int k = 0; k < arrays[a].count; k++) if (arrays[a].present[k]) slots.push_back({ a,k });
+	}
+	ygl::build_bvh(expanded);
+	check(sb->bvh->sorted_prim.size() == 1 + arrays.size(), "each array is a single leaf");
+
+	int num_hits = 0;
+	for (int i = 0; i < 20000; i++) {
+		auto o = ygl::vec3f{ ygl::next_rand1f(rng, -20, 20), ygl::next_rand1f(rng, -20, 20), ygl::next_rand1f(rng, -20, 20) };
+		auto target = ygl::vec3f{ ygl::next_rand1f(rng, -6, 6), ygl::next_rand1f(rng, -6, 6), ygl::next_rand1f(rng, -6, 6) };
+		auto ray = ygl::ray3f(o, ygl::normalize(target - o));
+		auto isec = yb::intersect_ray(*sb, ray, false);
+		auto ref = ygl::intersect_ray(expanded, ray, false);
+		check(bool(isec) == bool(ref), "arrays are hit as their windows");
+		if (!ref) continue;
+		num_hits++;
+		check(fabsf(isec.dist - ref.dist) < 1e-4f, "hits are at the same distance");
+		if (isec.dist == ref.dist) {
+			check(std::make_pair(isec.array_id, isec.slot_id) == slots[ref.iid], "the hit window is the same");
+			check(isec.eid == ref.eid, "the hit element is the same");
+		}
+		check(bool(yb::intersect_ray(*sb, ray, true)) == bool(ygl::intersect_ray(expanded, ray, true)),
+			"any hit is found");
+	}
+	check(num_hits > 1000, "rays hit the scene");
+
+	delete sb;
+	for (int i = 1; i < expanded->instances.size(); i++) delete expanded->instances[i];
+	expanded->instances.clear();
+	expanded->shapes.clear();
+	delete expanded;
+	scn->shapes.push_back(wnd_on);
+	scn->shapes.push_back(wnd_off);
+	delete scn;
+}
+
+void test_offset_polygon_far() {
+	// Far beyond the 32 bit range once scaled
+	for (auto o : { 0.f, 50000.f, 1000000.f }) {
+		std::vector<ygl::vec2f> square = { { o,o }, { o + 10,o }, { o + 10,o + 10 }, { o,o + 10 } };
+		auto offsets = yb::offset_polygon(square, std::vector<float>{ 1.f, -1.f });
+		for (int i = 0; i < 2; i++) {
+			check(offsets[i].size() == 1, "an offset square is one polygon");
+			auto bbox = ygl::invalid_bbox2f;
+			for (auto p : offsets[i][0]) bbox += p;
+			auto d = i == 0 ? 1.f : -1.f;
+			check(ygl::length(bbox.min - ygl::vec2f{ o - d, o - d }) < 0.1f &&
+				ygl::length(bbox.max - ygl::vec2f{ o + 10 + d, o + 10 + d }) < 0.1f,
+				"squares are offset in place");
+		}
+	}
+}
+
+void test_batch_transforms() {
+	auto rng = ygl::init_rng(15);
+	auto same = [](float a, float b) { return fabsf(a - b) <= 1e-6f * std::max(1.f, fabsf(a)); };
+	// Counts around multiples of 4 and 12 floats, so that the scalar tails
+	// run after the packed loops
+	for (int n = 0; n < 30; n++) {
+		std::vector<ygl::vec2f> pos2(n);
+		std::vector<ygl::vec3f> pos3(n);
+		for (auto& p : pos2) p = { ygl::next_rand1f(rng, -100, 100), ygl::next_rand1f(rng, -100, 100) };
+		for (auto& p : pos3) p = { ygl::next_rand1f(rng, -100, 100), ygl::next_rand1f(rng, -100, 100), ygl::next_rand1f(rng, -100, 100) };
+		auto d2 = ygl::vec2f{ 1.5f, -2.25f };
+		auto d3 = ygl::vec3f{ 1.5f, -2.25f, 3.125f };
+		auto angle = ygl::next_rand1f(rng, -3, 3);
+		auto c = cosf(angle), s = sinf(angle);
+
+		auto displaced2 = pos2, rotated2 = pos2, scaled2 = pos2;
+		auto displaced3 = pos3, scaled3 = pos3;
+		yb::displace(displaced2, d2);
+		yb::displace(displaced3, d3);
+		yb::rotate(rotated2, angle);
+		yb::scale(scaled2, 0.75f);
+		yb::scale(scaled3, -1.25f);
+		for (int i = 0; i < n; i++) {
+			auto p = pos2[i];
+			check(displaced2[i] == p + d2, "2d points are displaced");
+			check(same(rotated2[i].x, p.x*c - p.y*s) && same(rotated2[i].y, p.x*s + p.y*c), "2d points are rotated");
+			check(scaled2[i] == p * 0.75f, "2d points are scaled");
+			check(displaced3[i] == pos3[i] + d3, "3d points are displaced");
+			check(scaled3[i] == pos3[i] * -1.25f, "3d points are scaled");
+		}
+	}
+}
+
+// Saves a city and returns its OBJ, with the material library's name left out
+std::string save_city_obj(yb::city& cty) {
+	yb::save_city("test_city.obj", cty);
+	auto obj = read_file("test_city.obj");
+	obj.replace(obj.find("test_city.mtl"), 13, "");
+	remove("test_city.obj");
+	remove("test_city.mtl");
+	return obj;
+}
+
+// Checks that the city's scene BVH bounds its slots as tightly as a BVH
+// built from scratch, and finds the same hits
+void check_city_bvh(yb::city& cty) {
+	auto same_bbox = [](const ygl::bbox3f& a, const ygl::bbox3f& b) { return a.min == b.min && a.max == b.max; };
+	auto bvh = cty.scn->bvh;
+	for (const auto& node : bvh->nodes) {
+		auto bbox = ygl::invalid_bbox3f;
+		for (auto k = node.start; k < node.start + node.count; k++) {
+			bbox += node.isleaf ? yb::__get_slot_bbox(cty, bvh->sorted_prim[k]) : bvh->nodes[k].bbox;
+		}
+		check(same_bbox(node.bbox, bbox), "refit nodes bound their children");
+	}
+	auto fresh = ygl::build_bvh(int(cty.scn->instances.size()), true,
+		[&cty](int iid) { return yb::__get_slot_bbox(cty, iid); });
+	check(same_bbox(fresh->nodes[0].bbox, bvh->nodes[0].bbox), "the refit root is as tight as a fresh one");
+
+	auto rng = ygl::init_rng(17);
+	auto bbox = bvh->nodes[0].bbox;
+	for (int i = 0; i < 1000; i++) {
+		auto o = ygl::vec3f{ ygl::next_rand1f(rng, bbox.min.x, bbox.max.x), bbox.max.y + 10, ygl::next_rand1f(rng, bbox.min.z, bbox.max.z) };
+		auto ray = ygl::ray3f(o, ygl::normalize(ygl::vec3f{ ygl::next_rand1f(rng, -1, 1), -2, ygl::next_rand1f(rng, -1, 1) }));
+		auto isec = ygl::intersect_ray(cty.scn, ray, false);
+		std::swap(cty.scn->bvh, fresh);
+		auto ref = ygl::intersect_ray(cty.scn, ray, false);
+		std::swap(cty.scn->bvh, fresh);
+		// Instances with non-finite frames (see __get_slot_bbox) are hit at
+		// NaN distances whenever their leaf is visited, whatever the tree
+		if (std::isnan(isec.dist) || std::isnan(ref.dist)) continue;
+		check(bool(isec) == bool(ref) && (!ref || isec.dist == ref.dist), "refit and fresh BVHs find the same hits");
+	}
+	delete fresh;
+}
+
+void test_update_building() {
+	ygl::shape *open_window_shape, *closed_window_shape;
+	std::tie(open_window_shape, closed_window_shape) = yb::make_test_windows("wnd_op", "wnd_cls");
+	for (auto shp : { open_window_shape, closed_window_shape }) {
+		ygl::facet_shape(shp);
+		shp->norm = ygl::compute_normals(shp->lines, shp->triangles, shp->quads, shp->pos);
+	}
+	yb::city_params city_pars;
+	city_pars.buildings_per_side = 5;
+	city_pars.seed = 17;
+	city_pars.open_window_shape = open_window_shape;
+	city_pars.closed_window_shape = closed_window_shape;
+	city_pars.window_width = yb::get_window_width(open_window_shape, closed_window_shape);
+	auto cty = yb::make_city(city_pars);
+	yb::build_bvh(*cty);
+
+	// Same parameters, same scene
+	auto obj = save_city_obj(*cty);
+	for (int i = 0; i < cty->buildings.size(); i++) yb::update_building(*cty, i, *cty->buildings[i].params);
+	check(save_city_obj(*cty) == obj, "buildings made again with the same parameters are the same");
+	check_city_bvh(*cty);
+
+	// Fewer floors fit in the old slots, whose BVH leaves are refit
+	int num_refit = 0;
+	for (int i = 0; i < cty->buildings.size(); i++) {
+		auto& b = cty->buildings[i];
+		if (b.params->num_floors < 3) continue;
+		auto params = *b.params;
+		params.num_floors--;
+		auto first_slot = b.first_slot;
+		yb::update_building(*cty, i, params);
+		if (b.first_slot == first_slot) num_refit++;
+		check_city_bvh(*cty);
+	}
+	check(num_refit > 0, "some buildings are refit in place");
+	check(save_city_obj(*cty) != obj, "changed buildings change the scene");
+
+	// More floors need new slots and a new BVH
+	auto params = *cty->buildings[0].params;
+	params.num_floors += 10;
+	yb::update_building(*cty, 0, params);
+	check_city_bvh(*cty);
+
+	delete cty;
+	delete open_window_shape;
+	delete closed_window_shape;
+}
+
+// The allocation counter of profiler_alloc.cpp reaches the profile scopes
+void test_profile_bytes() {
+	auto prof = new yb::profiler();
+	yb::set_profiler(prof);
+	{
+		yb::profile_scope scope(yb::profile_stage::merge_shapes);
+		std::vector<char> data(1000);
+		check(data.size() == 1000, "data allocated");
+	}
+	yb::set_profiler(nullptr);
+	check(prof->buffers.size() == 1, "one thread recorded");
+	auto buf = prof->buffers.begin()->second;
+	check(buf->times[int(yb::profile_stage::merge_shapes)].size() == 1, "scope timed once");
+	check(buf->bytes[int(yb::profile_stage::merge_shapes)] >= 1000, "scope bytes counted");
+	delete prof;
+}
+
+// Alias table sampling follows the weights, and never picks a zero weight
+void test_sample_alias() {
+	std::vector<float> weights = { 2.f, 1.f, 0.5f, 0.f };
+	auto table = yb::make_alias_table(weights);
+	check(table.prob.size() == weights.size() && table.alias.size() == weights.size(), "table size");
+
+	auto rng = ygl::init_rng(7);
+	const int num_samples = 100000;
+	std::vector<int> counts(weights.size(), 0);
+	for (int i = 0; i < num_samples; i++) {
+		auto k = yb::sample_alias(rng, table);
+		check(k >= 0 && k < int(weights.size()), "sample in range");
+		counts[k]++;
+	}
+	check(counts[3] == 0, "zero weight never sampled");
+	for (auto k = 0; k < int(weights.size()); k++) {
+		// Five standard deviations of the binomial count
+		auto p = weights[k] / 3.5f;
+		auto tolerance = 5.f * std::sqrt(num_samples * p * (1.f - p)) + 1.f;
+		check(std::abs(counts[k] - num_samples * p) <= tolerance, "sample frequency");
+	}
+
+	// A single weight draws nothing from the rng
+	auto single = yb::make_alias_table(std::vector<float>{ 3.f });
+	auto rng_copy = rng;
+	check(yb::sample_alias(rng, single) == 0, "single entry sampled");
+	check(ygl::next_rand1i(rng, 1000) == ygl::next_rand1i(rng_copy, 1000), "single entry draws nothing");
+}
+
+// Twice the signed area of a polygon
+float polygon_area2(const std::vector<ygl::vec2f>& poly) {
+	float area = 0.f;
+	for (int i = 0; i < poly.size(); i++) area += ygl::cross(poly[i], poly[(i + 1) % poly.size()]);
+	return area;
+}
+
+void test_triangulation_paths() {
+	auto rng = ygl::init_rng(13);
+	// Checks that the triangles cover the polygon and are counterclockwise
+	auto check_triangles = [](
+		const std::vector<ygl::vec3i>& triangles,
+		const std::vector<ygl::vec2f>& pos,
+		float area2,
+		const std::string& path
+	) {
+		check(triangles.size() == pos.size() - 2, path + " makes n-2 triangles");
+		float sum = 0.f;
+		for (const auto& t : triangles) {
+			auto a = ygl::cross(pos[t.y] - pos[t.x], pos[t.z] - pos[t.x]);
+			check(a > 0.f, path + " triangles are counterclockwise");
+			sum += a;
+		}
+		check(fabsf(sum - fabsf(area2)) <= 1e-3f * fabsf(area2), path + " triangles cover the polygon");
+	};
+	for (int i = 0; i < 500; i++) {
+		// Convex: points on a circle at sorted random angles
+		auto n = 3 + ygl::next_rand1i(rng, 20);
+		std::vector<float> angles;
+		for (int k = 0; k < n; k++) angles.push_back(ygl::next_rand1f(rng) * 2 * ygl::pi);
+		std::sort(angles.begin(), angles.end());
+		angles.erase(std::unique(angles.begin(), angles.end()), angles.end());
+		std::vector<ygl::vec2f> convex;
+		for (auto a : angles) convex.push_back({ 10 * cosf(a), 10 * sinf(a) });
+		if (i % 2) std::reverse(convex.begin(), convex.end());
+
+		// y-monotone: a chain on each side of a vertical line, descending
+		// on the right and ascending on the left
+		std::vector<float> right_ys, left_ys;
+		for (int k = 0; k < n; k++) right_ys.push_back(ygl::next_rand1f(rng, -10.f, 10.f));
+		for (int k = 0; k < n; k++) left_ys.push_back(ygl::next_rand1f(rng, -10.f, 10.f));
+		std::sort(right_ys.begin(), right_ys.end(), std::greater<float>());
+		std::sort(left_ys.begin(), left_ys.end());
+		std::vector<ygl::vec2f> monotone = { { 0,11 } };
+		for (auto y : right_ys) monotone.push_back({ ygl::next_rand1f(rng, 0.5f, 10.f), y });
+		monotone.push_back({ 0,-11 });
+		for (auto y : left_ys) monotone.push_back({ -ygl::next_rand1f(rng, 0.5f, 10.f), y });
+		if (i % 2) std::reverse(monotone.begin(), monotone.end());
+
+		auto& trg = yb::get_thread_triangulator();
+		if (convex.size() >= 3) {
+			check(yb::classify_polygon(convex, {}) == yb::polygon_kind::convex, "circle points are convex");
+			check_triangles(yb::triangulate_convex(convex), convex, polygon_area2(convex), "convex");
+			check_triangles(std::get<0>(yb::triangulate_cdt_indexed(trg, convex)), convex, polygon_area2(convex), "cdt");
+		}
+		check(yb::classify_polygon(monotone, {}) != yb::polygon_kind::general, "chains are monotone");
+		check_triangles(yb::triangulate_monotone(monotone), monotone, polygon_area2(monotone), "monotone");
+		check_triangles(std::get<0>(yb::triangulate_cdt_indexed(trg, monotone)), monotone, polygon_area2(monotone), "cdt");
+	}
+
+	// Solids are thickened along the normal of counterclockwise triangles,
+	// whatever the border's orientation, also for self-intersecting borders
+	// that poly2tri only partially triangulates
+	auto square = yb::thicken_polygon(std::vector<ygl::vec2f>{ { 0,0 }, { 0,1 }, { 1,1 }, { 1,0 } }, 2.f);
+	auto bowtie = yb::thicken_polygon(std::vector<ygl::vec2f>{ { 0,0 }, { 1,1 }, { 1,0 }, { 0,1 } }, 2.f);
+	auto square_bbox = ygl::make_bbox(square->pos.size(), square->pos.data());
+	auto bowtie_bbox = ygl::make_bbox(bowtie->pos.size(), bowtie->pos.data());
+	check(square_bbox.min.y == bowtie_bbox.min.y && square_bbox.max.y == bowtie_bbox.max.y,
+		"solids are thickened to the same side");
+	delete square;
+	delete bowtie;
+}
+
+void test_compiled_grammar() {
+	// The start symbol has no rules: it is interned after the variables, as
+	// a terminal
+	std::vector<yb::production_rule<char>> rules = {
+		{ 'B', { 'x', 'A' }, 2.f },
+		{ 'A', { 'y' }, 1.f },
+		{ 'B', {}, 0.5f },
+		{ 'A', { 'B', 'z', 'S' }, 3.f }
+	};
+	yb::grammar<char> g('S');
+	g.add_rules(rules);
+	const auto& cg = g.compile();
+
+	check(cg.num_variables == 2, "the variables are interned first");
+	check(cg.symbols[cg.start] == 'S' && !cg.is_variable(cg.start), "a start without rules is a terminal");
+	for (int i = 0; i < cg.symbols.size(); i++) {
+		for (int j = 0; j < i; j++) check(cg.symbols[i] != cg.symbols[j], "each symbol is interned once");
+		check(cg.is_variable(i) == g.is_variable(cg.symbols[i]), "ids below num_variables are variables");
+	}
+	check(cg.rule_offsets.size() == cg.num_variables + 1 && cg.rule_offsets.back() == rules.size(),
+		"rule offsets cover all rules");
+	check(cg.rhs_offsets.size() == rules.size() + 1 && cg.rhs_offsets.back() == cg.rhs.size(),
+		"rhs offsets cover all right sides");
+	for (int v = 0; v < cg.num_variables; v++) {
+		// The variable's rules, in insertion order
+		std::vector<yb::production_rule<char>> var_rules;
+		for (const auto& rule : rules) {
+			if (rule.from == cg.symbols[v]) var_rules.push_back(rule);
+		}
+		check(cg.rule_offsets[v + 1] - cg.rule_offsets[v] == var_rules.size(), "each variable has its rules");
+		for (int k = 0; k < var_rules.size(); k++) {
+			auto r = cg.rule_offsets[v] + k;
+			check(cg.weights[r] == var_rules[k].weight, "rules keep their weights");
+			std::vector<char> to;
+			for (auto j = cg.rhs_offsets[r]; j < cg.rhs_offsets[r + 1]; j++) to.push_back(cg.symbols[cg.rhs[j]]);
+			check(to == var_rules[k].to, "rules keep their right sides");
+		}
+	}
+
+	auto rng = ygl::init_rng(21);
+	auto tree = g.produce(rng);
+	check(tree.size() == 1 && tree.value(0) == 'S', "a start without rules is the whole word");
+	g.add_rule('S', { 'A' });
+	check(g.compile().is_variable(g.compile().start), "adding a rule recompiles the grammar");
+}
+
+// A grammar whose words have at most 2^20 symbols: i -> (i+1)(i+1), or
+// i+1, or the terminal -1, up to the terminal 20
+yb::grammar<int> make_test_grammar() {
+	yb::grammar<int> g(0);
+	for (int i = 0; i < 20; i++) {
+		g.add_rules(i, std::vector<std::pair<std::vector<int>, float>>{
+			{ { i + 1, i + 1 }, 0.8f }, { { i + 1 }, 0.1f }, { { -1 }, 0.1f }
+		});
+	}
+	return g;
+}
+
+void test_parallel_derivation() {
+	auto g = make_test_grammar();
+	auto pool = ygl::make_pool(4);
+	size_t max_size = 0;
+	for (uint64_t seed = 0; seed < 8; seed++) {
+		auto tree = g.produce(seed);
+		auto pool_tree = g.produce(seed, pool);
+		max_size = std::max(max_size, tree.nodes.size());
+		check(tree.nodes.size() == pool_tree.nodes.size(), "same number of nodes with a pool");
+		for (int i = 0; i < tree.size(); i++) {
+			const auto &n = tree.nodes[i], &pn = pool_tree.nodes[i];
+			check(n.value == pn.value && n.parent == pn.parent &&
+				n.first_child == pn.first_child && n.next_sibling == pn.next_sibling,
+				"same node arrays with a pool");
+		}
+	}
+	check(max_size > 4 * yb::__parallel_derivation_tasks, "the trees are split into subtrees");
+	delete pool;
+}
+
+void test_word_stream() {
+	// 20 -> <empty> leaves variables among the tree's leaves, which are not
+	// part of the word
+	auto g = make_test_grammar();
+	g.add_rules(20, std::vector<std::pair<std::vector<int>, float>>{ { {}, 1.f }, { { 21 }, 1.f } });
+	for (uint64_t seed = 0; seed < 8; seed++) {
+		auto tree = g.produce(seed);
+		std::vector<int> word;
+		for (auto i : yb::leaves(tree)) {
+			if (g.is_terminal(tree.value(i))) word.push_back(tree.value(i));
+		}
+		std::vector<int> streamed;
+		auto ws = g.make_word_stream(seed);
+		while (auto symbol = yb::next_symbol(ws)) streamed.push_back(*symbol);
+		check(!word.empty() && streamed == word, "the stream is the produced word");
+	}
+
+	// 0 -> 0 0 never ends
+	yb::grammar<int> runaway(0);
+	runaway.add_rule(0, { 0,0 });
+	auto ws = runaway.make_word_stream(0, 64);
+	try {
+		while (yb::next_symbol(ws));
+		check(false, "runaway derivations are stopped");
+	}
+	catch (const std::runtime_error& e) {
+		check(std::string(e.what()) == "Too many pending symbols in the word stream",
+			"runaway derivations are stopped");
+	}
+}
 
 int main() {
-	printf("Per prove veloci\n");
-	return 0;
-}
\ No newline at end of file
+	std::vector<std::pair<const char*, void(*)()>> tests = {
+		{ "merge_same_points", test_merge_same_points },
+		{ "make_delete", test_make_delete },
+		{ "make_floors_from_regular", test_make_floors_from_regular },
+		{ "parallel_city_materials", test_parallel_city_materials },
+		{ "save_scene_with_arrays", test_save_scene_with_arrays },
+		{ "instance_array_bvh", test_instance_array_bvh },
+		{ "update_building", test_update_building },
+		{ "profile_bytes", test_profile_bytes },
+		{ "sample_alias", test_sample_alias },
+		{ "offset_polygon_far", test_offset_polygon_far },
+		{ "batch_transforms", test_batch_transforms },
+		{ "triangulation_paths", test_triangulation_paths },
+		{ "compiled_grammar", test_compiled_grammar },
+		{ "parallel_derivation", test_parallel_derivation },
+		{ "word_stream", test_word_stream },
+	};
+	int num_failed = 0;
+	for (const auto& test : tests) {
+		try {
+			test.second();
+			printf("ok      %s\n", test.first);
+		}
+		catch (const std::exception& e) {
+			printf("FAILED  %s: %s\n", test.first, e.what());
+			num_failed++;
+		}
+	}
+	return num_failed ? 1 : 0;
+}
@@ -1,14 +1,20 @@
 #ifndef YOCTO_UTILS_H
 #define YOCTO_UTILS_H
 
+#include <mutex>
+#include <unordered_map>
+#include <unordered_set>
+
 #include "yocto\yocto_gl.h"
+#include "arena.h"
+#include "profiler.h"
 
 namespace yb {
 
 	ygl::material* make_material(const std::string& name, const ygl::vec3f& kd,
 		ygl::texture* kd_txt = nullptr, const ygl::vec3f& ks = { 0.2f, 0.2f, 0.2f },
 		float rs = 0.01f) {
-		ygl::material* m = new ygl::material();
+		ygl::material* m = make_new<ygl::material>();
 		m->name = name;
 		m->kd = kd;
 		m->kd_txt.txt = kd_txt;
@@ -17,18 +23,119 @@ namespace yb {
 		return m;
 	}
 
+	/**
+	 * Interns materials, so that buildings with the same colors share them.
+	 *
+	 * Materials are keyed on (kd, ks, rs, ke, kd texture). If quantization is
+	 * positive, colors are first rounded to its multiples, so that similar
+	 * colors also share a material.
+	 * The cache can be used by several threads at once.
+	 */
+	struct material_cache {
+		struct key {
+			ygl::vec3f kd, ks, ke;
+			float rs;
+			ygl::texture* kd_txt;
+
+			bool operator==(const key& k) const {
+				return kd == k.kd && ks == k.ks && ke == k.ke && rs == k.rs && kd_txt == k.kd_txt;
+			}
+		};
+
+		struct key_hash {
+			size_t operator()(const key& k) const {
+				auto h = std::hash<const void*>()(k.kd_txt);
+				auto fh = std::hash<float>();
+				auto combine = [&h, &fh](float v) { h ^= fh(v) + 0x9e3779b9 + (h << 6) + (h >> 2); };
+				for (int i = 0; i < 3; i++) {
+					combine(k.kd[i]);
+					combine(k.ks[i]);
+					combine(k.ke[i]);
+				}
+				combine(k.rs);
+				return h;
+			}
+		};
+
+		float quantization = 0.f;
+		arena* mem = nullptr; // If set, materials are allocated from it rather than
+		                      // from the current arena
+		std::mutex mtx;
+		std::unordered_map<key, ygl::material*, key_hash> materials;
+	};
+
+	/**
+	 * Returns the cached material with the given properties, making it if
+	 * needed. Without a cache a new material is always made.
+	 *
+	 * Cached materials are shared by the threads using the cache, so they
+	 * are named here, under the lock, and never by make_instance. The
+	 * names are placeholders until name_cached_materials.
+	 */
+	ygl::material* get_material(
+		material_cache* cache,
+		const ygl::vec3f& kd,
+		ygl::texture* kd_txt = nullptr,
+		const ygl::vec3f& ks = { 0.2f, 0.2f, 0.2f },
+		float rs = 0.01f,
+		const ygl::vec3f& ke = ygl::zero3f
+	) {
+		if (!cache) {
+			auto m = make_material("", kd, kd_txt, ks, rs);
+			m->ke = ke;
+			return m;
+		}
+		auto k = material_cache::key{ kd, ks, ke, rs, kd_txt };
+		if (cache->quantization > 0.f) {
+			auto q = cache->quantization;
+			for (int i = 0; i < 3; i++) {
+				k.kd[i] = roundf(k.kd[i] / q) * q;
+				k.ks[i] = roundf(k.ks[i] / q) * q;
+				k.ke[i] = roundf(k.ke[i] / q) * q;
+			}
+		}
+		std::lock_guard<std::mutex> lock(cache->mtx);
+		auto& m = cache->materials[k];
+		if (!m) {
+			scoped_arena arena_scope(cache->mem ? cache->mem : get_current_arena());
+			m = make_material(
+				"cached_mat_" + std::to_string(cache->materials.size() - 1), k.kd, kd_txt, k.ks, rs
+			);
+			m->ke = k.ke;
+		}
+		return m;
+	}
+
+	/**
+	 * Names the cache's materials in order of appearance in the scene, so
+	 * that their names don't depend on which building used them first
+	 */
+	void name_cached_materials(
+		ygl::scene* scn,
+		material_cache* cache,
+		const std::string& prefix = "mat"
+	) {
+		std::unordered_set<ygl::material*> cached;
+		for (const auto& kv : cache->materials) cached.insert(kv.second);
+		int i = 0;
+		for (auto m : scn->materials) {
+			if (cached.count(m)) m->name = prefix + "_" + std::to_string(i++);
+		}
+	}
+
 	void add_light(ygl::scene* scn, const ygl::vec3f& pos, const ygl::vec3f& ke, const std::string& name) {
-		ygl::shape* lshp = new ygl::shape{ name + "_shape" };
+		ygl::shape* lshp = make_new<ygl::shape>();
+		lshp->name = name + "_shape";
 		lshp->pos.push_back(pos);
 		lshp->points.push_back(0);
 		lshp->radius.push_back(0.001f);
 		lshp->norm.push_back({ 0,0,1 });
 		lshp->color = { {1,1,1,1} };
-		ygl::instance* linst = new ygl::instance();
+		ygl::instance* linst = make_new<ygl::instance>();
 		linst->frame = ygl::identity_frame3f;
 		linst->name = name + "_instance";
 		linst->shp = lshp;
-		auto lmat = new ygl::material();
+		auto lmat = make_new<ygl::material>();
 		lmat->name = name+"_material";
 		lmat->ke = ke;
 		lmat->kd = ygl::zero3f;
@@ -101,6 +208,227 @@ namespace yb {
 		if (!found) scn->materials += inst->shp->mat;
 	}
 
+	/**
+	 * Accumulates instances (and their shapes and materials) to be added
+	 * to a scene.
+	 *
+	 * Shapes and materials already added are indexed by pointer, so each
+	 * addition is O(1) instead of a linear scan of the scene's vectors.
+	 * Nothing is written to the scene until commit is called.
+	 */
+	struct scene_builder {
+		ygl::scene* scn = nullptr;
+
+		std::vector<ygl::instance*> instances;
+		std::vector<ygl::shape*> shapes;
+		std::vector<ygl::material*> materials;
+
+		// Shapes and materials in either the scene or the pending vectors
+		std::unordered_set<ygl::shape*> shapes_index;
+		std::unordered_set<ygl::material*> materials_index;
+	};
+
+	/**
+	 * Makes a builder for the scene, indexing the shapes and materials the
+	 * scene already contains
+	 */
+	scene_builder make_scene_builder(ygl::scene* scn) {
+		scene_builder sb;
+		sb.scn = scn;
+		sb.shapes_index.insert(scn->shapes.begin(), scn->shapes.end());
+		sb.materials_index.insert(scn->materials.begin(), scn->materials.end());
+		return sb;
+	}
+
+	/**
+	 * Reserves space for the given number of additional instances, shapes
+	 * and materials
+	 */
+	void reserve(
+		scene_builder& sb,
+		size_t num_instances,
+		size_t num_shapes,
+		size_t num_materials
+	) {
+		sb.instances.reserve(sb.instances.size() + num_instances);
+		sb.shapes.reserve(sb.shapes.size() + num_shapes);
+		sb.materials.reserve(sb.materials.size() + num_materials);
+		sb.shapes_index.reserve(sb.shapes_index.size() + num_shapes);
+		sb.materials_index.reserve(sb.materials_index.size() + num_materials);
+	}
+
+	/**
+	 * Same as add_to_scene(ygl::scene*, ygl::instance*), with the instance
+	 * being held by the builder until commit
+	 */
+	void add_to_scene(scene_builder& sb, ygl::instance* inst) {
+		sb.instances += inst;
+		if (sb.shapes_index.insert(inst->shp).second) sb.shapes += inst->shp;
+		if (inst->shp->mat && sb.materials_index.insert(inst->shp->mat).second) {
+			sb.materials += inst->shp->mat;
+		}
+	}
+
+	void add_to_scene(scene_builder& sb, const std::vector<ygl::instance*>& insts) {
+		for (auto inst : insts) add_to_scene(sb, inst);
+	}
+
+	/**
+	 * Moves all pending elements into the builder's scene.
+	 * The builder can be used again afterwards.
+	 */
+	void commit(scene_builder& sb) {
+		auto scn = sb.scn;
+		scn->instances.insert(scn->instances.end(), sb.instances.begin(), sb.instances.end());
+		scn->shapes.insert(scn->shapes.end(), sb.shapes.begin(), sb.shapes.end());
+		scn->materials.insert(scn->materials.end(), sb.materials.begin(), sb.materials.end());
+		sb.instances.clear();
+		sb.shapes.clear();
+		sb.materials.clear();
+	}
+
+	/**
+	 * Approximate memory used by a shape's vertex and element data
+	 */
+	size_t get_shape_bytes(const ygl::shape* shp) {
+		return
+			shp->points.size() * sizeof(int) +
+			shp->lines.size() * sizeof(ygl::vec2i) +
+			shp->triangles.size() * sizeof(ygl::vec3i) +
+			shp->quads.size() * sizeof(ygl::vec4i) +
+			shp->pos.size() * sizeof(ygl::vec3f) +
+			shp->norm.size() * sizeof(ygl::vec3f) +
+			shp->texcoord.size() * sizeof(ygl::vec2f) +
+			shp->color.size() * sizeof(ygl::vec4f) +
+			shp->radius.size() * sizeof(float);
+	}
+
+	struct dedup_stats {
+		int num_shapes = 0; // Shapes in the scene before deduplication
+		int num_removed = 0; // Duplicate shapes removed from the scene
+		size_t bytes_saved = 0; // Vertex and element data of the removed shapes
+	};
+
+	/**
+	 * Finds the shapes in the scene which are equal up to a translation and
+	 * replaces them with a single shared shape.
+	 *
+	 * Each shape is hashed with its positions, relative to its bounding box
+	 * corner and quantised to eps, its elements and its material. Shapes with
+	 * duplicates are moved so that the corner is on the origin, and the offset
+	 * is moved into the frames of the instances referencing them.
+	 *
+	 * The duplicates are removed from the scene and deleted, or appended to
+	 * removed (e.g. because they're owned by an arena) if it's given.
+	 */
+	dedup_stats dedup_shapes(
+		ygl::scene* scn,
+		float eps = 0.0001f,
+		std::vector<ygl::shape*>* removed = nullptr
+	) {
+		dedup_stats stats;
+		stats.num_shapes = scn->shapes.size();
+
+		auto hash_combine = [](size_t h, size_t v) {
+			return h ^ (v + 0x9e3779b9 + (h << 6) + (h >> 2));
+		};
+		auto quantize = [eps](float v) { return (long long)roundf(v / eps); };
+		auto get_origin = [](const ygl::shape* shp) {
+			auto bbox = ygl::invalid_bbox3f;
+			for (const auto& p : shp->pos) bbox += p;
+			return shp->pos.empty() ? ygl::zero3f : bbox.min;
+		};
+		auto hash_shape = [&](const ygl::shape* shp, const ygl::vec3f& o) {
+			auto h = std::hash<const void*>()(shp->mat);
+			for (const auto& p : shp->pos) {
+				for (int c = 0; c < 3; c++) h = hash_combine(h, quantize(p[c] - o[c]));
+			}
+			h = hash_combine(h, shp->points.size());
+			for (auto v : shp->points) h = hash_combine(h, v);
+			h = hash_combine(h, shp->lines.size());
+			for (const auto& l : shp->lines) h = hash_combine(h, std::hash<ygl::vec2i>()(l));
+			h = hash_combine(h, shp->triangles.size());
+			for (const auto& t : shp->triangles) h = hash_combine(h, std::hash<ygl::vec3i>()(t));
+			h = hash_combine(h, shp->quads.size());
+			for (const auto& q : shp->quads) h = hash_combine(h, std::hash<ygl::vec4i>()(q));
+			return h;
+		};
+		auto close = [eps](const auto& v1, const auto& v2) {
+			if (v1.size() != v2.size()) return false;
+			for (int i = 0; i < v1.size(); i++) {
+				if (ygl::length(v1[i] - v2[i]) >= eps) return false;
+			}
+			return true;
+		};
+		auto same_shape = [&](
+			const ygl::shape* s1, const ygl::vec3f& o1,
+			const ygl::shape* s2, const ygl::vec3f& o2
+			) {
+			if (s1->mat != s2->mat || s1->pos.size() != s2->pos.size() ||
+				s1->points != s2->points || s1->lines != s2->lines ||
+				s1->triangles != s2->triangles || s1->quads != s2->quads ||
+				!s1->quads_pos.empty() || !s2->quads_pos.empty() ||
+				!close(s1->norm, s2->norm) || !close(s1->texcoord, s2->texcoord) ||
+				!close(s1->color, s2->color) || s1->radius != s2->radius
+				) {
+				return false;
+			}
+			for (int i = 0; i < s1->pos.size(); i++) {
+				if (ygl::length((s1->pos[i] - o1) - (s2->pos[i] - o2)) >= eps) return false;
+			}
+			return true;
+		};
+
+		// Group duplicates under the first shape found
+		std::vector<ygl::vec3f> origins(scn->shapes.size());
+		std::unordered_map<size_t, std::vector<int>> buckets; // Hash -> unique shapes
+		std::unordered_map<ygl::shape*, int> shape_ids;
+		std::vector<int> canonical(scn->shapes.size()); // Index of each shape's canonical shape
+		std::vector<bool> has_duplicates(scn->shapes.size(), false);
+		for (int i = 0; i < scn->shapes.size(); i++) {
+			auto shp = scn->shapes[i];
+			origins[i] = get_origin(shp);
+			auto& bucket = buckets[hash_shape(shp, origins[i])];
+			int found = i;
+			for (auto j : bucket) {
+				if (same_shape(scn->shapes[j], origins[j], shp, origins[i])) {
+					found = j;
+					break;
+				}
+			}
+			if (found == i) bucket.push_back(i);
+			else has_duplicates[found] = true;
+			canonical[i] = found;
+			shape_ids[shp] = i;
+		}
+
+		// Move the offsets into the instances' frames
+		for (auto inst : scn->instances) {
+			auto it = shape_ids.find(inst->shp);
+			if (it == shape_ids.end() || !has_duplicates[canonical[it->second]]) continue;
+			inst->frame.o = ygl::transform_point(inst->frame, origins[it->second]);
+			inst->shp = scn->shapes[canonical[it->second]];
+		}
+		std::vector<ygl::shape*> shapes;
+		for (int i = 0; i < scn->shapes.size(); i++) {
+			auto shp = scn->shapes[i];
+			if (canonical[i] == i) {
+				if (has_duplicates[i]) {
+					for (auto& p : shp->pos) p -= origins[i];
+				}
+				shapes.push_back(shp);
+			}
+			else {
+				stats.num_removed++;
+				stats.bytes_saved += get_shape_bytes(shp);
+				if (removed) removed->push_back(shp);
+				else delete shp;
+			}
+		}
+		scn->shapes = shapes;
+		return stats;
+	}
+
 	ygl::vec3f rand_color3f(ygl::rng_pcg32& rng) {
 		return { ygl::next_rand1f(rng), ygl::next_rand1f(rng), ygl::next_rand1f(rng) };
 	}
@@ -110,7 +438,7 @@ namespace yb {
 	}
 
 	ygl::instance* make_instance(const std::string& name, ygl::shape* shp) {
-		auto inst = new ygl::instance();
+		auto inst = make_new<ygl::instance>();
 		inst->name = name;
 		inst->shp = shp;
 		return inst;
@@ -121,16 +449,331 @@ namespace yb {
 		ygl::shape* shp,
 		ygl::material* mat
 	) {
-		auto inst = new ygl::instance();
+		auto inst = make_new<ygl::instance>();
 		inst->name = name + "_inst";
 		inst->shp = shp;
 		inst->shp->name = name + "_shp";
 		inst->shp->mat = mat;
+		// Cached materials, possibly shared with other threads, are named
+		// by get_material and left alone
 		if (mat->name.size() == 0) { // mat->name == ""
 			mat->name = name + "_mat";
 		}
 		return inst;
 	}
+
+	/**
+	 * A row of equally spaced instances, each using one of two shapes (e.g.
+	 * the windows on a side of a floor, either open or closed).
+	 *
+	 * The i-th slot is placed at frame, moved by i*step; slots with a false
+	 * present bit are empty, the others use shp_on or shp_off according to
+	 * their on bit.
+	 * An array takes the memory of a few instances, whatever its size.
+	 */
+	struct instance_array {
+		std::string name; // Instances are named name_<first_id + k> when expanded
+		int first_id = 0;
+		ygl::frame3f frame = ygl::identity_frame3f; // Frame of the first slot
+		ygl::vec3f step = ygl::zero3f; // World space displacement between slots
+		int count = 0;
+		ygl::shape* shp_on = nullptr;
+		ygl::shape* shp_off = nullptr;
+		std::vector<bool> present;
+		std::vector<bool> on;
+
+		// computed data --------------------------
+		ygl::bbox3f bbox = ygl::invalid_bbox3f; // Needs to be updated explicitly
+	};
+
+	void translate(instance_array& arr, const ygl::vec3f& d) {
+		arr.frame.o = arr.frame.o + d;
+	}
+
+	/**
+	 * Makes one instance for each present slot of the array
+	 */
+	std::vector<ygl::instance*> expand_instance_array(const instance_array& arr) {
+		std::vector<ygl::instance*> insts;
+		int id = arr.first_id;
+		for (int i = 0; i < arr.count; i++) {
+			if (!arr.present[i]) continue;
+			auto inst = make_instance(
+				arr.name + "_" + std::to_string(id++),
+				arr.on[i] ? arr.shp_on : arr.shp_off
+			);
+			inst->frame = arr.frame;
+			inst->frame.o = arr.frame.o + arr.step*float(i);
+			insts.push_back(inst);
+		}
+		return insts;
+	}
+
+	/**
+	 * Updates the world space bounding box of the array
+	 */
+	void update_bbox(instance_array& arr) {
+		auto shp_bbox = ygl::invalid_bbox3f;
+		for (auto shp : { arr.shp_on, arr.shp_off }) {
+			if (shp) for (const auto& p : shp->pos) shp_bbox += p;
+		}
+		auto first = ygl::transform_bbox(arr.frame, shp_bbox);
+		arr.bbox = first;
+		if (arr.count > 1) {
+			auto disp = arr.step*float(arr.count - 1);
+			arr.bbox += first.min + disp;
+			arr.bbox += first.max + disp;
+		}
+	}
+
+	/**
+	 * Returns the world space bounding box of the scene's instances and of
+	 * the given instance arrays
+	 */
+	ygl::bbox3f get_bbox(const ygl::scene* scn, std::vector<instance_array>& arrays) {
+		auto bbox = ygl::invalid_bbox3f;
+		std::unordered_map<ygl::shape*, ygl::bbox3f> shp_bboxes;
+		for (auto inst : scn->instances) {
+			auto it = shp_bboxes.find(inst->shp);
+			if (it == shp_bboxes.end()) {
+				auto shp_bbox = ygl::invalid_bbox3f;
+				for (const auto& p : inst->shp->pos) shp_bbox += p;
+				it = shp_bboxes.insert({ inst->shp, shp_bbox }).first;
+			}
+			// Empty shapes' boxes are invalid and can't be transformed
+			if (it->second.min.x > it->second.max.x) continue;
+			bbox += ygl::transform_bbox(inst->frame, it->second);
+		}
+		for (auto& arr : arrays) {
+			update_bbox(arr);
+			bbox += arr.bbox;
+		}
+		return bbox;
+	}
+
+	/**
+	 * Intersects an instance array with a ray. Find any interstion if
+	 * early_exit, otherwise find first intersection.
+	 *
+	 * Only the slots whose extent along the step overlaps the ray's are
+	 * tested, so the cost doesn't depend on the array's size.
+	 * The shapes' BVHs must be already built.
+	 *
+	 * Returns the hit slot in slot_id, the other outputs are as in
+	 * ygl::intersect_ray.
+	 */
+	bool intersect_ray(
+		const instance_array& arr,
+		const ygl::ray3f& ray_,
+		bool early_exit,
+		float& ray_t,
+		int& slot_id,
+		int& eid,
+		ygl::vec4f& euv
+	) {
+		// Work in the frame of the first slot
+		auto ray = ygl::transform_ray_inverse(arr.frame, ray_);
+		auto step = ygl::transform_vector_inverse(arr.frame, arr.step);
+		auto shp_bbox = ygl::invalid_bbox3f;
+		for (auto shp : { arr.shp_on, arr.shp_off }) if (shp) shp_bbox += shp->bbox;
+		auto swept_bbox = shp_bbox;
+		swept_bbox += shp_bbox.min + step*float(arr.count - 1);
+		swept_bbox += shp_bbox.max + step*float(arr.count - 1);
+
+		// Ray extent inside the array's box
+		auto tmin = ray.tmin, tmax = ray.tmax;
+		for (int c = 0; c < 3; c++) {
+			auto dinv = 1.f / ray.d[c];
+			auto t0 = (swept_bbox.min[c] - ray.o[c]) * dinv;
+			auto t1 = (swept_bbox.max[c] - ray.o[c]) * dinv;
+			if (t0 > t1) std::swap(t0, t1);
+			tmin = std::max(tmin, t0);
+			tmax = std::min(tmax, t1);
+		}
+		if (tmin > tmax) return false;
+
+		// Slots overlapped by the ray in that extent
+		int kmin = 0, kmax = arr.count - 1;
+		auto step_len2 = ygl::dot(step, step);
+		if (step_len2 > 0.f) {
+			// Extent of a slot along the step, in units of steps
+			auto smin = ygl::dot(shp_bbox.min, step) / step_len2;
+			auto smax = smin;
+			for (int c = 0; c < 8; c++) {
+				auto corner = ygl::vec3f{
+					(c & 1) ? shp_bbox.max.x : shp_bbox.min.x,
+					(c & 2) ? shp_bbox.max.y : shp_bbox.min.y,
+					(c & 4) ? shp_bbox.max.z : shp_bbox.min.z
+				};
+				auto sc = ygl::dot(corner, step) / step_len2;
+				smin = std::min(smin, sc);
+				smax = std::max(smax, sc);
+			}
+			auto s0 = ygl::dot(ray.o + ray.d*tmin, step) / step_len2;
+			auto s1 = ygl::dot(ray.o + ray.d*tmax, step) / step_len2;
+			if (s0 > s1) std::swap(s0, s1);
+			kmin = std::max(kmin, int(floorf(s0 - smax)));
+			kmax = std::min(kmax, int(ceilf(s1 - smin)));
+		}
+
+		auto hit = false;
+		for (int k = kmin; k <= kmax; k++) {
+			if (!arr.present[k]) continue;
+			auto shp = arr.on[k] ? arr.shp_on : arr.shp_off;
+			auto slot_ray = ray;
+			slot_ray.o = ray.o - step*float(k);
+			if (ygl::intersect_ray(shp, slot_ray, early_exit, ray_t, eid, euv)) {
+				hit = true;
+				slot_id = k;
+				if (early_exit) return true;
+				ray.tmax = ray_t;
+			}
+		}
+		return hit;
+	}
+
+	/**
+	 * A BVH over a scene's instances and over instance arrays kept out of
+	 * the scene, each array being a single leaf: windows kept as arrays
+	 * cost one leaf per row instead of one per window.
+	 *
+	 * Leaves 0 to num_instances - 1 are the scene's instances, the others
+	 * the arrays. The scene and the arrays must outlive the BVH and not
+	 * change meanwhile.
+	 */
+	struct scene_bvh {
+		const ygl::scene* scn = nullptr;
+		const std::vector<instance_array>* arrays = nullptr;
+		int num_instances = 0;
+		ygl::bvh_tree* bvh = nullptr;
+
+		scene_bvh() {}
+		scene_bvh(const scene_bvh&) = delete;
+		scene_bvh& operator=(const scene_bvh&) = delete;
+		~scene_bvh() { if (bvh) delete bvh; }
+	};
+
+	/**
+	 * Builds the BVH of a scene and of instance arrays (see scene_bvh),
+	 * including, if do_shapes, the BVHs of the scene's and arrays' shapes
+	 */
+	scene_bvh* make_scene_bvh(
+		ygl::scene* scn,
+		std::vector<instance_array>& arrays,
+		bool do_shapes = true
+	) {
+		if (do_shapes) {
+			std::unordered_set<ygl::shape*> shapes;
+			for (auto shp : scn->shapes) shapes.insert(shp);
+			for (const auto& arr : arrays) {
+				for (auto shp : { arr.shp_on, arr.shp_off }) if (shp) shapes.insert(shp);
+			}
+			for (auto shp : shapes) ygl::build_bvh(shp);
+		}
+		for (auto inst : scn->instances) inst->bbox = ygl::transform_bbox(inst->frame, inst->shp->bbox);
+		for (auto& arr : arrays) update_bbox(arr);
+
+		auto sb = new scene_bvh();
+		sb->scn = scn;
+		sb->arrays = &arrays;
+		sb->num_instances = scn->instances.size();
+		sb->bvh = ygl::build_bvh(sb->num_instances + int(arrays.size()), true, [sb](int eid) {
+			return eid < sb->num_instances ?
+				sb->scn->instances[eid]->bbox : (*sb->arrays)[eid - sb->num_instances].bbox;
+		});
+		return sb;
+	}
+
+	/**
+	 * Intersection with a scene_bvh: either iid is the hit scene instance,
+	 * or array_id and slot_id are the hit array and slot
+	 */
+	struct array_intersection_point : ygl::intersection_point {
+		int array_id = -1;
+		int slot_id = -1;
+	};
+
+	/**
+	 * Intersects a scene and its instance arrays with a ray. Find any
+	 * interstion if early_exit, otherwise find first intersection.
+	 */
+	array_intersection_point intersect_ray(const scene_bvh& sb, const ygl::ray3f& ray, bool early_exit) {
+		array_intersection_point isec;
+		int leaf = -1, slot_id = -1;
+		auto hit = ygl::intersect_bvh(sb.bvh, ray, early_exit, isec.dist, leaf,
+			[&](int leaf, const ygl::ray3f& ray, float& ray_t) {
+				if (leaf < sb.num_instances) {
+					return ygl::intersect_ray(sb.scn->instances[leaf], ray, early_exit, ray_t, isec.eid, isec.euv);
+				}
+				return intersect_ray(
+					(*sb.arrays)[leaf - sb.num_instances], ray, early_exit, ray_t, slot_id, isec.eid, isec.euv
+				);
+			}
+		);
+		if (!hit) return {};
+		if (leaf < sb.num_instances) {
+			isec.iid = leaf;
+		}
+		else {
+			isec.array_id = leaf - sb.num_instances;
+			isec.slot_id = slot_id;
+		}
+		return isec;
+	}
+
+	/**
+	 * Removes the shapes and their materials from the scene without deleting
+	 * them, e.g. when they're shared with other scenes
+	 */
+	void remove_from_scene(ygl::scene* scn, const std::vector<ygl::shape*>& shps) {
+		std::unordered_set<void*> removed;
+		for (auto shp : shps) {
+			removed.insert(shp);
+			if (shp->mat) removed.insert(shp->mat);
+		}
+		auto remove = [&removed](auto& v) {
+			v.erase(std::remove_if(v.begin(), v.end(),
+				[&removed](void* ptr) { return removed.count(ptr) > 0; }), v.end());
+		};
+		remove(scn->shapes);
+		remove(scn->materials);
+	}
+
+	/**
+	 * Saves a scene together with instance arrays, which are temporarily
+	 * expanded into the scene's instances (as OBJ and glTF have no notion of
+	 * instance arrays). The arrays' shapes and materials missing from the
+	 * scene are temporarily added too.
+	 */
+	void save_scene(
+		const std::string& filename,
+		ygl::scene* scn,
+		const std::vector<instance_array>& arrays,
+		const ygl::save_options& opts = ygl::save_options()
+	) {
+		profile_scope prof(profile_stage::save_scene);
+		auto num_instances = scn->instances.size();
+		auto num_shapes = scn->shapes.size();
+		auto num_materials = scn->materials.size();
+		std::unordered_set<ygl::shape*> shapes(scn->shapes.begin(), scn->shapes.end());
+		std::unordered_set<ygl::material*> materials(scn->materials.begin(), scn->materials.end());
+		for (const auto& arr : arrays) {
+			for (auto shp : { arr.shp_on, arr.shp_off }) {
+				if (!shp || !shapes.insert(shp).second) continue;
+				scn->shapes.push_back(shp);
+				if (shp->mat && materials.insert(shp->mat).second) scn->materials.push_back(shp->mat);
+			}
+			auto insts = expand_instance_array(arr);
+			scn->instances.insert(scn->instances.end(), insts.begin(), insts.end());
+		}
+		ygl::save_scene(filename, scn, opts);
+		for (auto i = num_instances; i < scn->instances.size(); i++) {
+			make_delete(scn->instances[i]);
+		}
+		scn->instances.resize(num_instances);
+		scn->shapes.resize(num_shapes);
+		scn->materials.resize(num_materials);
+	}
 }
 
 #endif // YOCTO_UTILS_H